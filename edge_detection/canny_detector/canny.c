@@ -1,7 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
-#include <float.h>
 #include "netpbm.h"
 
 //funct for convolution
@@ -28,177 +28,818 @@ Matrix convolve(Matrix m1, Matrix m2) {
     return res;
 }
 
-//funct for sobel edge detection
-Image sobel(Image img) {
-    double sobelx[3][3]={{-1,0,1}, {-2,0,2}, {-1,0,1}}; //for horizontal detection
-    double sobely[3][3]={{-1,-2,-1}, {0,0,0}, {1,2,1}}; //for vertical detection
-    
-    Matrix sobelX=createMatrixFromArray(&sobelx[0][0], 3, 3);
-    Matrix sobelY=createMatrixFromArray(&sobely[0][0], 3, 3);
-    
-    Matrix img_matrix=image2Matrix(img); //convert image to a matrix of intensity values
-    Matrix resx=convolve(img_matrix, sobelX); //calculate horizontal gradients
-    Matrix resy=convolve(img_matrix, sobelY); //calculate vertical gradients
-    
-    Matrix sobelres=createMatrix(img.height, img.width);
-    
-    //to track max and min values in result
-    double maxval=-DBL_MAX;
-    double minval=DBL_MAX;
-    
-    for(int i=0; i<img.height; i++) {
-        for(int j=0; j<img.width; j++) {
-            sobelres.map[i][j]=sqrt(pow(resx.map[i][j], 2) + pow(resy.map[i][j], 2));
-            if(sobelres.map[i][j]>maxval) 
-                maxval = sobelres.map[i][j];
-            if(sobelres.map[i][j]<minval) 
-                minval = sobelres.map[i][j];
+//labels in the thresholded edge map
+#define WEAK 128
+#define STRONG 255
+
+//funct to smooth source row s of an intensity channel with the 3x3 gaussian [1 2 1]x[1 2 1]
+//rows and columns on the border get 0 like in convolve
+static void smoothRow(ChannelView img, int s, short *dst) {
+    int width=img.width;
+    memset(dst, 0, sizeof(short)*width);
+    if(s<1 || s>=img.height-1)
+        return;
+
+    const unsigned char *a=img.data+img.stride*(s-1), *b=a+img.stride, *c=b+img.stride;
+    int step=img.step;
+    for(int j=1; j<width-1; j++) {
+        int l=(j-1)*step, m=j*step, r=(j+1)*step;
+        dst[j]=(a[l]+2*a[m]+a[r]) + 2*(b[l]+2*b[m]+b[r]) + (c[l]+2*c[m]+c[r]);
+    }
+}
+
+//funct to compute sobel gradients and squared magnitudes of a smoothed row from its neighbours s0 and s2
+static void gradientRow(const short *s0, const short *s1, const short *s2, int width, short *gx, short *gy, int *mag2) {
+    gx[0]=gy[0]=gx[width-1]=gy[width-1]=0;
+    mag2[0]=mag2[width-1]=0;
+    for(int j=1; j<width-1; j++) {
+        int x=(s0[j+1]-s0[j-1]) + 2*(s1[j+1]-s1[j-1]) + (s2[j+1]-s2[j-1]);
+        int y=(s2[j-1]+2*s2[j]+s2[j+1]) - (s0[j-1]+2*s0[j]+s0[j+1]);
+        gx[j]=x;
+        gy[j]=y;
+        mag2[j]=x*x + y*y;
+    }
+}
+
+//funct for non-maximum suppression of one row given the squared magnitudes of the rows above (m0), at (m1) and below (m2)
+//the gradient direction is binned into horizontal, vertical and the two diagonals straight from gx and gy:
+//with ax=|gx| and ay=|gy| the angle is within 22.5 degrees of horizontal if ay<tan(22.5)*ax, i.e. ay+ax<sqrt(2)*ax,
+//and within 22.5 degrees of vertical if ay>tan(67.5)*ax, i.e. ay-ax>sqrt(2)*ax - squaring both sides keeps the
+//comparisons exact in integers; otherwise the signs of gx and gy pick the diagonal
+//squared magnitudes compare like magnitudes; the comparisons are branch-free so that the loop vectorizes, and the
+//survivors go to kept before they are written as whole magnitudes (rounded down), which keeps every comparison
+//with an integer threshold exact
+static void suppressRow(const short *gx, const short *gy, const int *m0, const int *m1, const int *m2, int width,
+                        int *kept, unsigned short *dst) {
+    for(int j=1; j<width-1; j++) {
+        int ax=abs(gx[j]), ay=abs(gy[j]);
+        int horizontal=(ax+ay)*(ax+ay) < 2*ax*ax;
+        int vertical=(ay>ax) & ((ay-ax)*(ay-ax) > 2*ax*ax);
+        int rising=(gx[j]^gy[j])>=0; //same signs - compare along (i+1,j-1)-(i-1,j+1)
+
+        //compare current pixel with its neighbors along the gradient direction
+        int q=horizontal ? m1[j+1] : vertical ? m2[j] : rising ? m2[j-1] : m0[j-1];
+        int r=horizontal ? m1[j-1] : vertical ? m0[j] : rising ? m0[j+1] : m2[j+1];
+
+        //suppress minimum points
+        int magnitude=m1[j];
+        kept[j]=((magnitude>=q) & (magnitude>=r)) ? magnitude : 0;
+    }
+
+    dst[0]=dst[width-1]=0;
+    for(int j=1; j<width-1; j++)
+        dst[j]=kept[j] ? (unsigned short)sqrt((double)kept[j]) : 0;
+}
+
+//number of bins of a gradient magnitude histogram - whole magnitudes of the smoothed sobel gradients
+//are at most sqrt(2)*4*16*255<23081
+#define MAGNITUDE_BINS 23081
+
+//funct for the fused canny pipeline on rows first..first+count-1 and columns left..left+cols-1 of an intensity channel
+//smoothing, gradients and non-maximum suppression run row by row through rolling windows of 3 rows each,
+//so no full-frame intermediate is kept; the suppressed magnitude of pixel (y,x) goes to out[(y-first)*outStride+x-left]
+//the windows span the block's columns plus the 3 source columns on each side that the three stages need
+//(1 each for smoothing, gradients and suppression); border pixels of the frame get 0 like in the frame-at-a-time version
+//unless histogram is NULL, the whole gradient magnitudes (before suppression) of the inner pixels of the block
+//are added to its MAGNITUDE_BINS bins on the way
+void cannyBlock(ChannelView img, int first, int count, int left, int cols, unsigned short *out, size_t outStride,
+                unsigned int *histogram) {
+    int height=img.height;
+    if(img.width<3 || height<3) {
+        for(int y=0; y<count; y++)
+            memset(out+(size_t)y*outStride, 0, sizeof(unsigned short)*cols);
+        return;
+    }
+
+    //narrow the view to the block and its halo; the view's own border columns get 0 in the windows, which is
+    //right on the frame border and only reaches 2 columns into the halo elsewhere
+    int lo=MAX(left-3, 0), hi=MIN(left+cols+3, img.width), offset=left-lo;
+    img.data+=(ptrdiff_t)img.step*lo;
+    img.width=hi-lo;
+    int width=img.width;
+
+    //rolling windows: smoothed rows, and gradients plus squared magnitudes of gradient rows,
+    //followed by the row of magnitudes kept by suppression and the suppressed row
+    void *buffer=alignedMalloc((sizeof(short)*3 + sizeof(int))*3*width + sizeof(int)*width + sizeof(unsigned short)*width);
+    short *smooth[3], *gradx[3], *grady[3];
+    int *mag2[3], *kept=(int *)buffer+3*width;
+    for(int r=0; r<3; r++) {
+        mag2[r]=(int *)buffer+r*width;
+        smooth[r]=(short *)(kept+width)+3*r*width;
+        gradx[r]=smooth[r]+width;
+        grady[r]=smooth[r]+2*width;
+    }
+    unsigned short *row=(unsigned short *)(smooth[2]+3*width);
+
+    int nextSmooth=MAX(first-2, 0), nextGradient=MAX(first-1, 0); //next rows to compute
+    for(int y=first; y<first+count; y++) {
+        unsigned short *dst=out+(size_t)(y-first)*outStride;
+        if(y<1 || y>=height-1) { //ignoring border pixels
+            memset(dst, 0, sizeof(unsigned short)*cols);
+            continue;
+        }
+        for(; nextGradient<=y+1; nextGradient++) {
+            int r=nextGradient;
+            for(; nextSmooth<=MIN(r+1, height-1); nextSmooth++)
+                smoothRow(img, nextSmooth, smooth[nextSmooth%3]);
+            if(r<1 || r>=height-1) {
+                memset(gradx[r%3], 0, sizeof(short)*width);
+                memset(grady[r%3], 0, sizeof(short)*width);
+                memset(mag2[r%3], 0, sizeof(int)*width);
+            } else
+                gradientRow(smooth[(r-1)%3], smooth[r%3], smooth[(r+1)%3], width, gradx[r%3], grady[r%3], mag2[r%3]);
+        }
+        //a block of whole rows is suppressed straight into the output
+        suppressRow(gradx[y%3], grady[y%3], mag2[(y-1)%3], mag2[y%3], mag2[(y+1)%3], width, kept, cols==width ? dst : row);
+        if(cols<width)
+            memcpy(dst, row+offset, sizeof(unsigned short)*cols);
+        if(histogram) {
+            for(int j=MAX(offset, 1); j<MIN(offset+cols, width-1); j++)
+                histogram[(int)sqrt((double)mag2[y%3][j])]++;
         }
     }
-    
-    //scale to 0-255
-    Image res=matrix2Image(sobelres, 1, 1.0);
-    
-    deleteMatrix(sobelX);
-    deleteMatrix(sobelY);
-    deleteMatrix(img_matrix);
-    deleteMatrix(resx);
-    deleteMatrix(resy);
-    deleteMatrix(sobelres);
-    
-    return res;
+
+    alignedFree(buffer);
 }
 
-//funct for canny edge detection
-Image canny(Image img) {
-    //step 1: smoothing using 3x3 Gaussian filter
-    double gaussdata[3][3]={{1, 2, 1}, {2, 4, 2}, {1, 2, 1}};
-    Matrix gaussfilter=createMatrixFromArray(&gaussdata[0][0], 3, 3);
-    
-    Matrix img_matrix=image2Matrix(img); //convert image to a matrix of intensity values
-    Matrix smooth_matrix=convolve(img_matrix, gaussfilter); //apply guass filter using convolution - smoothing
-    
-    //step 2: Sobel edge detection on the smoothed image
-    Image sobel_img=sobel(matrix2Image(smooth_matrix, 0, 1.0));
+//funct for the fused canny pipeline on rows first..first+count-1 of an intensity channel
+//the suppressed magnitudes of row y go to out+(y-first)*width, see cannyBlock
+void cannyRows(ChannelView img, int first, int count, unsigned short *out, unsigned int *histogram) {
+    cannyBlock(img, first, count, 0, img.width, out, img.width, histogram);
+}
 
-    Matrix gradx, grady;
-    double sobelx[3][3]={{-1,0,1}, {-2,0,2}, {-1, 0,1}};
-    double sobely[3][3]={{-1, -2,-1}, {0,0,0}, {1,2,1}};
+//tiles of the tiled passes: tile t covers rows (t/columns)*rows.. and columns (t%columns)*cols.. of the frame,
+//the last tiles of a row or column of tiles are cut off by the frame border
+typedef struct {
+    int height, width, rows, cols;
+    int columns, count; //number of tiles per row of tiles, and in total
+} TileGrid;
+
+//funct to split a frame into tiles of the given size
+TileGrid tileGrid(int height, int width, int tileRows, int tileCols) {
+    TileGrid g={height, width, MAX(tileRows, 1), MAX(tileCols, 1), 0, 0};
+    g.columns=(width+g.cols-1)/g.cols;
+    g.count=(height+g.rows-1)/g.rows*g.columns;
+    return g;
+}
 
-    gradx=convolve(smooth_matrix, createMatrixFromArray(&sobelx[0][0], 3,3)); //gradient in x direction
-    grady=convolve(smooth_matrix, createMatrixFromArray(&sobely[0][0], 3,3)); //gradient in y direction
+//funct to get the rows first..last-1 and columns left..right-1 of tile t
+static void tileBounds(TileGrid g, int t, int *first, int *last, int *left, int *right) {
+    *first=t/g.columns*g.rows;
+    *last=MIN(*first+g.rows, g.height);
+    *left=t%g.columns*g.cols;
+    *right=MIN(*left+g.cols, g.width);
+}
 
-    //store gradient magnitude and direction
-    Matrix gradientMagnitude=createMatrix(img.height, img.width);
-    Matrix gradientDirection =createMatrix(img.height, img.width);
+//columns per tile: the rolling windows of a tile take about 40 bytes per column, so they stay within the
+//L1 and L2 caches even on very wide frames, while the halo adds only 6 columns
+#define TILE_COLS 1024
 
-    for(int i=0; i<img.height; i++) {
-        for(int j=0; j<img.width; j++) {
-            gradientMagnitude.map[i][j]=sqrt(pow(gradx.map[i][j], 2)+pow(grady.map[i][j], 2));
-            gradientDirection.map[i][j]=atan2(grady.map[i][j], gradx.map[i][j]);
+//funct to pick the tiles for the given number of threads (0 - one per processor):
+//TILE_COLS columns and about four tiles per thread so that uneven tiles balance out, but no fewer than 64 rows,
+//since every tile recomputes a few halo rows
+TileGrid tileGridFor(int height, int width, int threads) {
+    if(threads<=0)
+        threads=processorCount();
+    int columns=(width+TILE_COLS-1)/TILE_COLS;
+    int rowsOfTiles=MAX((4*threads+columns-1)/columns, 1);
+    return tileGrid(height, width, MAX(64, (height+rowsOfTiles-1)/rowsOfTiles), TILE_COLS);
+}
+
+//shared state of the tiled fused pass
+typedef struct {
+    ChannelView img;
+    unsigned short *out;
+    unsigned int **histograms; //one per tile, NULL - no histogram
+    TileGrid grid;
+} CannyTiles;
+
+//funct to run the fused pass on one tile into its own pixels of the output
+static void cannyTile(void *arg, int t) {
+    CannyTiles *c=(CannyTiles *)arg;
+    int first, last, left, right;
+    unsigned int *histogram=NULL;
+
+    tileBounds(c->grid, t, &first, &last, &left, &right);
+    if(c->histograms)
+        histogram=c->histograms[t]=(unsigned int *)calloc(MAGNITUDE_BINS, sizeof(unsigned int));
+    cannyBlock(c->img, first, last-first, left, right-left, c->out+(size_t)first*c->img.width+left, c->img.width, histogram);
+}
+
+//funct for the fused pass on the tiles of a grid, run on a thread pool
+//each tile reads the source pixels it needs around it and recomputes the smoothed and gradient values of
+//that halo, so the tiles are independent and the result, histogram included, is identical to cannyRows on the whole frame
+void cannyRowsTiled(ChannelView img, unsigned short *out, unsigned int *histogram, TileGrid grid, ThreadPool *pool) {
+    CannyTiles c={img, out, NULL, grid};
+    int tiles=grid.count;
+
+    if(histogram)
+        c.histograms=(unsigned int **)calloc(tiles, sizeof(unsigned int *));
+    runThreadPool(pool, tiles, cannyTile, &c);
+
+    if(histogram) {
+        for(int t=0; t<tiles; t++) {
+            for(int b=0; b<MAGNITUDE_BINS; b++)
+                histogram[b]+=c.histograms[t][b];
+            free(c.histograms[t]);
         }
+        free(c.histograms);
     }
+}
 
-    //step 3: non-maximum suppression
-    Matrix nonmaxsuppressed=createMatrix(img.height, img.width);
-    for(int i=1; i<img.height-1; i++) { //ignoring border pixels
-        for(int j=1; j<img.width-1; j++) {
-            double angle = gradientDirection.map[i][j]*180.0/PI;
-            angle=fmod(angle+180.0, 180.0);
+//funct to label suppressed magnitudes as STRONG (>=high), WEAK (>=low) or 0 in rows first..last-1 and columns left..right-1
+//pixels on the frame border are never edges, so the tracking below needs no bounds checks
+//returns the number of edge pixels (weak or strong) in this block
+static size_t thresholdBlock(const unsigned short *nms, int height, int width, int first, int last, int left, int right,
+                             int low_threshold, int high_threshold, unsigned char *edges) {
+    size_t found=0;
+    for(int i=first; i<last; i++) {
+        const unsigned short *src=nms+(size_t)i*width;
+        unsigned char *dst=edges+(size_t)i*width;
+        if(i<1 || i>=height-1) {
+            memset(dst+left, 0, right-left);
+            continue;
+        }
+        if(left==0)
+            dst[0]=0;
+        if(right==width)
+            dst[width-1]=0;
+        for(int j=MAX(left, 1); j<MIN(right, width-1); j++) {
+            if(src[j]>=high_threshold)
+                dst[j]=STRONG; //edge is strong
+            else if(src[j]>=low_threshold)
+                dst[j]=WEAK; //edge is weak
+            else
+                dst[j]=0; //not an edge
+            found+=dst[j]!=0;
+        }
+    }
+    return found;
+}
 
-            double magnitude=gradientMagnitude.map[i][j];
-            double q=0, r=0;
-            
-            //check gradient direction and compare current pixel with its neighbors along this direction
-            if((angle>=0 && angle<22.5)||(angle>= 157.5 && angle<180)) {
-                q=gradientMagnitude.map[i][j+1];
-                r=gradientMagnitude.map[i][j-1];
-            } else if(angle>=22.5 && angle<67.5) {
-                q=gradientMagnitude.map[i+1][j-1];
-                r=gradientMagnitude.map[i-1][j+1];
-            } else if(angle>=67.5 && angle<112.5) {
-                q=gradientMagnitude.map[i+1][j];
-                r=gradientMagnitude.map[i-1][j];
-            } else if(angle>=112.5 && angle<157.5) {
-                q=gradientMagnitude.map[i-1][j-1];
-                r=gradientMagnitude.map[i+1][j+1];
+//funct for hysteresis thresholding of suppressed magnitudes into an edge map of 0 and STRONG
+//every weak pixel 8-connected to a strong pixel through other weak pixels becomes strong, the others are dropped;
+//the strong pixels are grown with an explicit stack, so each pixel is pushed at most once
+void hysteresis(const unsigned short *nms, int height, int width, int low_threshold, int high_threshold,
+                unsigned char *edges) {
+    size_t found=thresholdBlock(nms, height, width, 0, height, 0, width, low_threshold, high_threshold, edges);
+    size_t *stack=(size_t *)alignedMalloc(sizeof(size_t)*MAX(found, 1)); //exits if out of memory
+    size_t top=0;
+    ptrdiff_t neighbours[8]={-width-1, -width, -width+1, -1, 1, width-1, width, width+1};
+
+    for(size_t k=0; k<(size_t)height*width; k++) {
+        if(edges[k]==STRONG)
+            stack[top++]=k;
+    }
+    while(top>0) {
+        size_t k=stack[--top];
+        for(int n=0; n<8; n++) {
+            size_t l=k+neighbours[n];
+            if(edges[l]==WEAK) {
+                edges[l]=STRONG; //connected so - strong
+                stack[top++]=l;
             }
+        }
+    }
+    for(size_t k=0; k<(size_t)height*width; k++) {
+        if(edges[k]==WEAK)
+            edges[k]=0; //not connected so - suppress
+    }
+    alignedFree(stack);
+}
+
+//union-find over the edge pixels for the tiled hysteresis: parent[k] is the parent of pixel k,
+//or for the root of a component -1 (weak pixels only) or -2 (at least one strong pixel)
+//pixel indices are ptrdiff_t, so that frames of more than 2^31 pixels work like in hysteresis
+#define ROOT_WEAK -1
+#define ROOT_STRONG -2
 
-            //suppress minimum points
-            if(magnitude>=q && magnitude>=r) {
-                nonmaxsuppressed.map[i][j]=magnitude;
-            } else{
-                nonmaxsuppressed.map[i][j]= 0;
+//funct to find the root of pixel k, halving the path on the way
+static ptrdiff_t findRoot(ptrdiff_t *parent, ptrdiff_t k) {
+    while(parent[k]>=0) {
+        if(parent[parent[k]]>=0)
+            parent[k]=parent[parent[k]];
+        k=parent[k];
+    }
+    return k;
+}
+
+//funct to merge the components of pixels a and b; the merged component is strong if either was
+static void unite(ptrdiff_t *parent, ptrdiff_t a, ptrdiff_t b) {
+    a=findRoot(parent, a);
+    b=findRoot(parent, b);
+    if(a==b)
+        return;
+    if(a>b) {
+        ptrdiff_t t=a; a=b; b=t;
+    }
+    parent[a]=MIN(parent[a], parent[b]); //ROOT_STRONG wins
+    parent[b]=a;
+}
+
+//shared state of the tiled hysteresis
+typedef struct {
+    const unsigned short *nms;
+    unsigned char *edges;
+    ptrdiff_t *parent;
+    TileGrid grid;
+    int low_threshold, high_threshold;
+} HysteresisTiles;
+
+//funct to merge the component of edge pixel k with those of its edge neighbours to the left and above,
+//either only the ones inside the tile (inside=1) or only the ones in other tiles (inside=0)
+static void uniteNeighbours(HysteresisTiles *h, int i, int j, int first, int left, int right, int inside) {
+    int width=h->grid.width;
+    ptrdiff_t k=(ptrdiff_t)i*width+j;
+
+    if((j>left)==inside && h->edges[k-1])
+        unite(h->parent, k, k-1);
+    for(int d=-1; d<=1; d++) {
+        int same=i>first && j+d>=left && j+d<right;
+        if(same==inside && h->edges[k-width+d])
+            unite(h->parent, k, k-width+d);
+    }
+}
+
+//funct to threshold one tile and union its edge pixels with their neighbours inside the tile
+//a tile only touches parent entries of its own pixels, so tiles can run at the same time
+static void labelTile(void *arg, int t) {
+    HysteresisTiles *h=(HysteresisTiles *)arg;
+    int width=h->grid.width, first, last, left, right;
+
+    tileBounds(h->grid, t, &first, &last, &left, &right);
+    thresholdBlock(h->nms, h->grid.height, width, first, last, left, right, h->low_threshold, h->high_threshold, h->edges);
+    for(int i=first; i<last; i++) {
+        for(int j=left; j<right; j++) {
+            ptrdiff_t k=(ptrdiff_t)i*width+j;
+            if(h->edges[k]==0)
+                continue;
+            h->parent[k]=h->edges[k]==STRONG ? ROOT_STRONG : ROOT_WEAK;
+            uniteNeighbours(h, i, j, first, left, right, 1);
+        }
+    }
+}
+
+//funct to keep the edge pixels of one tile whose component is strong
+//roots are only read here, so tiles can again run at the same time
+static void resolveTile(void *arg, int t) {
+    HysteresisTiles *h=(HysteresisTiles *)arg;
+    int width=h->grid.width, first, last, left, right;
+
+    tileBounds(h->grid, t, &first, &last, &left, &right);
+    for(int i=first; i<last; i++) {
+        for(ptrdiff_t k=(ptrdiff_t)i*width+left; k<(ptrdiff_t)i*width+right; k++) {
+            if(h->edges[k]==0)
+                continue;
+            ptrdiff_t root=k;
+            while(h->parent[root]>=0)
+                root=h->parent[root];
+            h->edges[k]=h->parent[root]==ROOT_STRONG ? STRONG : 0;
+        }
+    }
+}
+
+//funct for hysteresis thresholding on the tiles of a grid, run on a thread pool
+//each tile labels its weak and strong pixels into connected components, the components that meet across
+//tile borders are merged, and every pixel is kept if its component holds a strong pixel;
+//the result is identical to hysteresis
+void hysteresisTiled(const unsigned short *nms, int low_threshold, int high_threshold, unsigned char *edges,
+                     TileGrid grid, ThreadPool *pool) {
+    HysteresisTiles h={nms, edges, NULL, grid, low_threshold, high_threshold};
+
+    h.parent=(ptrdiff_t *)alignedMalloc(sizeof(ptrdiff_t)*grid.height*grid.width);
+    runThreadPool(pool, grid.count, labelTile, &h);
+
+    //merge components across tile borders: the first row and the first and last columns of every tile
+    //are the only pixels with neighbours to the left or above in other tiles
+    for(int t=0; t<grid.count; t++) {
+        int first, last, left, right;
+        tileBounds(grid, t, &first, &last, &left, &right);
+        for(int i=first; i<last; i++) {
+            for(int j=left; j<right; j++) {
+                if(i>first && j>left && j<right-1)
+                    j=right-1; //skip to the last column
+                if(edges[(size_t)i*grid.width+j])
+                    uniteNeighbours(&h, i, j, first, left, right, 0);
             }
         }
     }
 
-    //step 4: hysteresis thresholding
-    double low_threshold=2000;
-    double high_threshold=2400;
-
-    Matrix thresholded=createMatrix(img.height, img.width);
-
-    for(int i=0; i<img.height; i++) {
-        for(int j=0; j<img.width; j++) {
-            if(nonmaxsuppressed.map[i][j]>=high_threshold) {
-                thresholded.map[i][j] = 255; //edge is strong
-            } else if(nonmaxsuppressed.map[i][j]>=low_threshold) {
-                thresholded.map[i][j] = 128; //edge is weak
-            } else {
-                thresholded.map[i][j]=0; //not an edge
+    runThreadPool(pool, grid.count, resolveTile, &h);
+    alignedFree(h.parent);
+}
+
+//ways to choose the hysteresis thresholds - given on the command line, or derived from the
+//gradient magnitude histogram of the image by Otsu's method or a percentile rule
+typedef enum {MANUAL, OTSU, PERCENTILE} ThresholdMode;
+const char *thresholdModeNames[]={"manual", "otsu", "percentile"};
+
+typedef struct {
+    ThresholdMode mode;
+    int low, high; //thresholds on the gradient magnitude - given in MANUAL mode, derived otherwise
+    double percentile; //PERCENTILE: fraction of the pixels that lie below the high threshold
+    double ratio; //OTSU and PERCENTILE: low threshold as a fraction of the high one
+} CannyThresholds;
+
+//funct for otsu's method on a magnitude histogram
+//returns the bin that best splits the histogram into two classes, i.e. maximizes the between-class variance
+int otsuThreshold(const unsigned int *histogram, int bins) {
+    double total=0, sum=0;
+    for(int t=0; t<bins; t++) {
+        total+=histogram[t];
+        sum+=(double)t*histogram[t];
+    }
+
+    double below=0, sumBelow=0, best=-1;
+    int threshold=0;
+    for(int t=0; t<bins; t++) {
+        if(below>0 && below<total) { //class 0 is bins 0..t-1, class 1 bins t..bins-1
+            double mean0=sumBelow/below, mean1=(sum-sumBelow)/(total-below);
+            double variance=below*(total-below)*(mean0-mean1)*(mean0-mean1);
+            if(variance>best) {
+                best=variance;
+                threshold=t;
             }
         }
+        below+=histogram[t];
+        sumBelow+=(double)t*histogram[t];
+    }
+    return threshold;
+}
+
+//funct for the percentile rule on a magnitude histogram
+//returns the smallest magnitude above which less than the fraction 1-percentile of the pixels lie
+int percentileThreshold(const unsigned int *histogram, int bins, double percentile) {
+    double total=0;
+    for(int t=0; t<bins; t++)
+        total+=histogram[t];
+
+    double below=0;
+    for(int t=0; t<bins; t++) {
+        below+=histogram[t];
+        if(below>=percentile*total)
+            return t+1;
+    }
+    return bins;
+}
+
+//funct to fill in the thresholds of the automatic modes from the magnitude histogram
+void chooseThresholds(CannyThresholds *t, const unsigned int *histogram) {
+    if(t->mode==MANUAL)
+        return;
+    t->high=t->mode==OTSU ? otsuThreshold(histogram, MAGNITUDE_BINS)
+                          : percentileThreshold(histogram, MAGNITUDE_BINS, t->percentile);
+    t->high=MAX(t->high, 1);
+    t->low=MAX((int)(t->ratio*t->high + 0.5), 1);
+}
+
+//funct to convert an edge map into an image
+Image edges2Image(const unsigned char *edges, int height, int width) {
+    Image res=createImage(height, width);
+    for(int i=0; i<height; i++) {
+        for(int j=0; j<width; j++) {
+            unsigned char v=edges[(size_t)i*width+j];
+            res.map[i][j].r=res.map[i][j].g=res.map[i][j].b=res.map[i][j].i=v;
+        }
+    }
+    return res;
+}
+
+//funct for canny edge detection on an intensity channel
+//in the automatic modes the thresholds are derived from the magnitude histogram gathered by the fused pass
+//and written back to *thresholds; with more than one thread (0 - one per processor) the frame is split into tiles
+//that run in parallel on one thread pool for all passes, with the same result as on one thread
+Image canny(ChannelView img, CannyThresholds *thresholds, int threads) {
+    unsigned int *histogram=NULL;
+    if(thresholds->mode!=MANUAL)
+        histogram=(unsigned int *)calloc(MAGNITUDE_BINS, sizeof(unsigned int));
+    TileGrid grid=tileGridFor(img.height, img.width, threads);
+    ThreadPool *pool=threads==1 ? NULL : createThreadPool(threads);
+
+    //steps 1-3: smoothing, gradients and non-maximum suppression in one pass
+    unsigned short *nms=(unsigned short *)alignedMalloc(sizeof(unsigned short)*img.height*img.width);
+    if(threads==1)
+        cannyRows(img, 0, img.height, nms, histogram);
+    else
+        cannyRowsTiled(img, nms, histogram, grid, pool);
+    chooseThresholds(thresholds, histogram);
+    int low_threshold=thresholds->low;
+    int high_threshold=thresholds->high;
+
+    //step 4: hysteresis thresholding
+    unsigned char *edges=(unsigned char *)alignedMalloc((size_t)img.height*img.width);
+    if(threads==1)
+        hysteresis(nms, img.height, img.width, low_threshold, high_threshold, edges);
+    else
+        hysteresisTiled(nms, low_threshold, high_threshold, edges, grid, pool);
+
+    //create final binary image
+    Image res=edges2Image(edges, img.height, img.width);
+
+    if(pool)
+        deleteThreadPool(pool);
+    alignedFree(nms);
+    alignedFree(edges);
+    free(histogram);
+    return res;
+}
+
+//largest number of values in each threshold list of a sweep
+#define MAX_SWEEP_VALUES 64
+
+//shared state of a parameter sweep; pair k has low threshold lows[k/nhighs] and high threshold highs[k%nhighs]
+typedef struct {
+    const unsigned short *nms; //suppressed magnitudes, computed once for all pairs
+    int height, width;
+    const int *lows, *highs;
+    int nhighs;
+    char *cannyFilename; //NULL - no edge maps are written
+    Image groundTruth; //map NULL - no metrics are computed
+    double *precision, *recall, *fMeasure;
+} CannySweep;
+
+//funct to calculate evaluation metrics of an edge map against a binary ground truth as edge_evaluator does
+void evaluateEdges(Image groundTruth, const unsigned char *edges, double *precision, double *recall, double *fMeasure) {
+    int tp=0, fp=0, fn=0;
+
+    for(int y=0; y<groundTruth.height; y++) {
+        for(int x=0; x<groundTruth.width; x++) {
+            int gt=groundTruth.map[y][x].i>128;                       //ground truth (binary)
+            int det=edges[(size_t)y*groundTruth.width+x]>128;       //detected edges (binary)
+
+            if (gt && det) tp++;  //true positive
+            if (!gt && det) fp++; //false positive
+            if (gt && !det) fn++; //false negative
+        }
+    }
+
+    //an empty edge map or ground truth scores 0 instead of dividing by 0
+    *precision=tp+fp>0 ? (double)tp/(tp + fp) : 0.0;
+    *recall=tp+fn>0 ? (double)tp/(tp + fn) : 0.0;
+    *fMeasure=*precision+*recall>0 ? 2*(*precision * *recall) / (*precision + *recall) : 0.0;
+}
+
+//funct to run hysteresis for one pair of thresholds of a sweep and write and/or evaluate the edge map
+static void sweepPair(void *arg, int k) {
+    CannySweep *sweep=(CannySweep *)arg;
+    int low=sweep->lows[k/sweep->nhighs], high=sweep->highs[k%sweep->nhighs];
+    if(low>high)
+        return; //not a valid pair
+    unsigned char *edges=(unsigned char *)alignedMalloc((size_t)sweep->height*sweep->width);
+
+    hysteresis(sweep->nms, sweep->height, sweep->width, low, high, edges);
+
+    if(sweep->cannyFilename) {
+        //name the output after the thresholds: out.pgm -> out_<low>_<high>.pgm
+        char filename[1024];
+        char *dot=strrchr(sweep->cannyFilename, '.');
+        int stem=dot ? (int)(dot-sweep->cannyFilename) : (int)strlen(sweep->cannyFilename);
+        snprintf(filename, sizeof(filename), "%.*s_%d_%d%s", stem, sweep->cannyFilename, low, high, dot ? dot : "");
+
+        Image res=edges2Image(edges, sweep->height, sweep->width);
+        writeImage(res, filename);
+        deleteImage(res);
+    }
+    if(sweep->groundTruth.map)
+        evaluateEdges(sweep->groundTruth, edges, &sweep->precision[k], &sweep->recall[k], &sweep->fMeasure[k]);
+
+    alignedFree(edges);
+}
+
+//funct for the parameter sweep: smoothing, gradients and non-maximum suppression run once,
+//then every pair of a low and a high threshold with low<=high goes through hysteresis on the cached suppressed magnitudes;
+//pairs run in parallel on the given number of threads (0 - one per processor)
+//each edge map is written next to cannyFilename unless it is NULL, and scored against the ground truth unless that is NULL
+void cannySweep(ChannelView img, char *cannyFilename, char *truthFilename, const int *lows, int nlows,
+                const int *highs, int nhighs, int threads) {
+    CannySweep sweep={NULL, img.height, img.width, lows, highs, nhighs, cannyFilename, {0, 0, NULL, NULL, 0}, NULL, NULL, NULL};
+    int pairs=nlows*nhighs;
+
+    if(truthFilename) {
+        sweep.groundTruth=readImage(truthFilename);
+        if(sweep.groundTruth.height!=img.height || sweep.groundTruth.width!=img.width) {
+            fprintf(stderr, "Ground truth %s does not have the size of the input image.\n", truthFilename);
+            exit(1);
+        }
     }
+    sweep.precision=(double *)calloc(pairs, sizeof(double));
+    sweep.recall=(double *)calloc(pairs, sizeof(double));
+    sweep.fMeasure=(double *)calloc(pairs, sizeof(double));
+
+    ThreadPool *pool=createThreadPool(threads);
+    unsigned short *nms=(unsigned short *)alignedMalloc(sizeof(unsigned short)*img.height*img.width);
+    cannyRowsTiled(img, nms, NULL, tileGridFor(img.height, img.width, threads), pool);
+    sweep.nms=nms;
 
+    runThreadPool(pool, pairs, sweepPair, &sweep);
+    deleteThreadPool(pool);
+
+    if(truthFilename) {
+        int best=-1;
+        printf("%8s %8s %10s %10s %10s\n", "low", "high", "precision", "recall", "F-measure");
+        for(int k=0; k<pairs; k++) {
+            if(lows[k/nhighs]>highs[k%nhighs])
+                continue;
+            printf("%8d %8d %10.3f %10.3f %10.3f\n", lows[k/nhighs], highs[k%nhighs],
+                   sweep.precision[k], sweep.recall[k], sweep.fMeasure[k]);
+            if(best<0 || sweep.fMeasure[k]>sweep.fMeasure[best])
+                best=k;
+        }
+        if(best>=0)
+            printf("Best F-measure %.3f at low %d, high %d\n", sweep.fMeasure[best], lows[best/nhighs], highs[best%nhighs]);
+        deleteImage(sweep.groundTruth);
+    }
+
+    alignedFree(nms);
+    free(sweep.precision);
+    free(sweep.recall);
+    free(sweep.fMeasure);
+}
+
+//funct to parse a comma-separated list of thresholds such as 1000,1500,2000
+//returns the number of values, at most MAX_SWEEP_VALUES
+int parseThresholdList(const char *list, int *values) {
+    int count=0;
+    while(*list && count<MAX_SWEEP_VALUES) {
+        char *end;
+        values[count++]=(int)strtol(list, &end, 10);
+        if(end==list)
+            break;
+        list=*end==',' ? end+1 : end;
+    }
+    return count;
+}
+
+//funct to check that the tiled fused pass and the tiled hysteresis give the same results as on the whole frame
+//small tiles are used so that many edges cross tile borders; returns the number of pixels that differ
+int checkTiled(ChannelView img) {
+    TileGrid grid=tileGrid(img.height, img.width, 7, 13);
+    ThreadPool *pool=createThreadPool(0);
+    size_t size=(size_t)img.height*img.width;
+    unsigned short *nms=(unsigned short *)alignedMalloc(sizeof(unsigned short)*size);
+    unsigned short *tiledNms=(unsigned short *)alignedMalloc(sizeof(unsigned short)*size);
+    unsigned char *edges=(unsigned char *)alignedMalloc(size);
+    unsigned char *tiled=(unsigned char *)alignedMalloc(size);
+    unsigned int *histogram=(unsigned int *)calloc(MAGNITUDE_BINS, sizeof(unsigned int));
+    unsigned int *tiledHistogram=(unsigned int *)calloc(MAGNITUDE_BINS, sizeof(unsigned int));
+
+    cannyRows(img, 0, img.height, nms, histogram);
+    cannyRowsTiled(img, tiledNms, tiledHistogram, grid, pool);
+    hysteresis(nms, img.height, img.width, 2000, 2400, edges);
+    hysteresisTiled(tiledNms, 2000, 2400, tiled, grid, pool);
+
+    int differences=0;
+    for(size_t k=0; k<size; k++)
+        differences+=nms[k]!=tiledNms[k] || edges[k]!=tiled[k];
+    if(memcmp(histogram, tiledHistogram, sizeof(unsigned int)*MAGNITUDE_BINS)!=0)
+        differences++;
+
+    alignedFree(nms);
+    alignedFree(tiledNms);
+    alignedFree(edges);
+    alignedFree(tiled);
+    free(histogram);
+    free(tiledHistogram);
+    deleteThreadPool(pool);
+    return differences;
+}
+
+//funct to check the fused pipeline against smoothing, gradients and non-maximum suppression on doubles
+//returns the number of suppressed magnitudes that differ (after rounding down)
+int checkFusedPipeline(ChannelView img) {
+    double gaussdata[3][3]={{1, 2, 1}, {2, 4, 2}, {1, 2, 1}};
+    double sobelx[3][3]={{-1,0,1}, {-2,0,2}, {-1, 0,1}};
+    double sobely[3][3]={{-1, -2,-1}, {0,0,0}, {1,2,1}};
+    Matrix gaussfilter=createMatrixFromArray(&gaussdata[0][0], 3, 3);
+    Matrix sobelX=createMatrixFromArray(&sobelx[0][0], 3, 3);
+    Matrix sobelY=createMatrixFromArray(&sobely[0][0], 3, 3);
+
+    Matrix img_matrix=channel2Matrix(img);
+    Matrix smooth_matrix=convolve(img_matrix, gaussfilter);
+    Matrix gradx=convolve(smooth_matrix, sobelX);
+    Matrix grady=convolve(smooth_matrix, sobelY);
+
+    unsigned short *nms=(unsigned short *)alignedMalloc(sizeof(unsigned short)*img.height*img.width);
+    cannyRows(img, 0, img.height, nms, NULL);
+
+    int differences=0;
     for(int i=1; i<img.height-1; i++) {
         for(int j=1; j<img.width-1; j++) {
-            if(thresholded.map[i][j]==128) {
-                if(thresholded.map[i+1][j]==255 || thresholded.map[i-1][j] ==255 ||
-                    thresholded.map[i][j+1]==255 || thresholded.map[i][j-1] ==255 ||
-                    thresholded.map[i+1][j+1]==255 || thresholded.map[i-1][j-1] ==255 ||
-                    thresholded.map[i+1][j-1]==255 || thresholded.map[i-1][j+1] ==255) {
-                    thresholded.map[i][j] =255; //connected so - strong
-                } else {
-                    thresholded.map[i][j]=0; //not connected so - suppress
-                }
+            double magnitude=sqrt(pow(gradx.map[i][j], 2)+pow(grady.map[i][j], 2));
+            double angle=atan2(grady.map[i][j], gradx.map[i][j])*180.0/PI;
+            angle=fmod(angle+180.0, 180.0);
+
+            int di=0, dj=1; //offset of the neighbour q along the gradient, r is on the opposite side
+            if(angle>=22.5 && angle<67.5) {
+                di=1; dj=-1;
+            } else if(angle>=67.5 && angle<112.5) {
+                di=1; dj=0;
+            } else if(angle>=112.5 && angle<157.5) {
+                di=-1; dj=-1;
             }
+            double q=sqrt(pow(gradx.map[i+di][j+dj], 2)+pow(grady.map[i+di][j+dj], 2));
+            double r=sqrt(pow(gradx.map[i-di][j-dj], 2)+pow(grady.map[i-di][j-dj], 2));
+            double suppressed=(magnitude>=q && magnitude>=r) ? magnitude : 0;
+
+            if(floor(suppressed)!=nms[(size_t)i*img.width+j])
+                differences++;
         }
     }
 
-    //create final binary image
-    Image res = matrix2Image(thresholded,0,1.0);
-
     deleteMatrix(gaussfilter);
+    deleteMatrix(sobelX);
+    deleteMatrix(sobelY);
+    deleteMatrix(img_matrix);
     deleteMatrix(smooth_matrix);
     deleteMatrix(gradx);
     deleteMatrix(grady);
-    deleteMatrix(gradientMagnitude);
-    deleteMatrix(gradientDirection);
-    deleteMatrix(nonmaxsuppressed);
-    deleteMatrix(thresholded);
+    alignedFree(nms);
 
-    return res;
+    return differences;
 }
 
-
 //edge detection function as per question
-void edgeDetection(char *inputFilename, char *cannyFilename) {
-    Image img=readImage(inputFilename);
+void edgeDetection(char *inputFilename, char *cannyFilename, CannyThresholds thresholds, int threads, int check) {
+    //only the intensity plane is loaded - 8-bit grayscale files are used straight from the file mapping
+    PlanarImage img=readPlanarImage(inputFilename, 0);
+
+    if(check) {
+        int differences=checkFusedPipeline(planeView(img, img.i));
+        printf("Fused pipeline: %d suppressed magnitudes differ from the double reference\n", differences);
+        differences=checkTiled(planeView(img, img.i));
+        printf("Tiled pipeline: %d pixels differ from the whole-frame one\n", differences);
+    }
     
     //call canny
-    Image canny_img=canny(img);
+    Image canny_img=canny(planeView(img, img.i), &thresholds, threads);
     writeImage(canny_img, cannyFilename);
+    if(thresholds.mode!=MANUAL)
+        printf("%s thresholds: low %d, high %d\n", thresholdModeNames[thresholds.mode], thresholds.low, thresholds.high);
     
     //clean up
-    deleteImage(img);
+    deletePlanarImage(img);
     deleteImage(canny_img);
 }
 
-int main() {
+int main(int argc, char **argv) {
     char *inputFile = "/Users/sumukharadhya/Downloads/CV/TermProject/edge_detection/canny_detector/inputs/6.ppm";
     char *cannyFile = "/Users/sumukharadhya/Downloads/CV/TermProject/edge_detection/canny_detector/outputs/color/6_op.ppm";
 
-    edgeDetection(inputFile, cannyFile);
+    CannyThresholds thresholds={MANUAL, 2000, 2400, 0.7, 0.4}; //percentile and ratio as in matlab's edge()
+    int threads=0; //0 - one per processor
+    int check=0;
+    int lows[MAX_SWEEP_VALUES], highs[MAX_SWEEP_VALUES], nlows=0, nhighs=0; //no sweep unless given
+    char *truthFile=NULL;
+    int metricsOnly=0;
+
+    //paths given on the command line override the defaults
+    if(argc>2) {
+        inputFile=argv[1];
+        cannyFile=argv[2];
+    }
+    for(int a=3; a<argc; a++) {
+        if(strcmp(argv[a], "-threads")==0 && a+1<argc)
+            threads=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-thresholds")==0 && a+2<argc) {
+            thresholds.mode=MANUAL;
+            thresholds.low=atoi(argv[++a]);
+            thresholds.high=atoi(argv[++a]);
+        } else if(strcmp(argv[a], "-auto")==0 && a+1<argc) {
+            a++;
+            for(int m=OTSU; m<=PERCENTILE; m++)
+                if(strcmp(argv[a], thresholdModeNames[m])==0)
+                    thresholds.mode=(ThresholdMode)m;
+        } else if(strcmp(argv[a], "-percentile")==0 && a+1<argc)
+            thresholds.percentile=atof(argv[++a]);
+        else if(strcmp(argv[a], "-ratio")==0 && a+1<argc)
+            thresholds.ratio=atof(argv[++a]);
+        else if(strcmp(argv[a], "-sweep")==0 && a+2<argc) {
+            nlows=parseThresholdList(argv[++a], lows);
+            nhighs=parseThresholdList(argv[++a], highs);
+        } else if(strcmp(argv[a], "-truth")==0 && a+1<argc)
+            truthFile=argv[++a];
+        else if(strcmp(argv[a], "-metrics")==0)
+            metricsOnly=1;
+        else if(strcmp(argv[a], "-check")==0)
+            check=1;
+    }
+
+    if(thresholds.percentile<=0.0 || thresholds.percentile>1.0 || thresholds.ratio<=0.0 || thresholds.ratio>1.0) {
+        fprintf(stderr, "Percentile and ratio must be greater than 0 and at most 1.\n");
+        return 1;
+    }
+
+    if(nlows>0 && nhighs>0) {
+        if(metricsOnly && !truthFile) {
+            fprintf(stderr, "-metrics needs a ground truth given with -truth.\n");
+            return 1;
+        }
+        PlanarImage img=readPlanarImage(inputFile, 0);
+        cannySweep(planeView(img, img.i), metricsOnly ? NULL : cannyFile, truthFile, lows, nlows, highs, nhighs, threads);
+        deletePlanarImage(img);
+        return 0;
+    }
+
+    edgeDetection(inputFile, cannyFile, thresholds, threads, check);
     return 0;
 }
\ No newline at end of file
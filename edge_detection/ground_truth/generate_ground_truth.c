@@ -1,53 +1,161 @@
 #include "netpbm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
-//funct to generate a ground truth edge map from an input image
-Image generateGroundTruth(Image img) {
-    Image edgeMap=createImage(img.height, img.width);
+//funct for convolution
+Matrix convolve(Matrix m1, Matrix m2) {
+    int i,j,x,y, fheight, fwidth;
+    Matrix res=createMatrix(m1.height, m1.width);
+    
+    //find center of filter
+    fheight=m2.height/2;
+    fwidth=m2.width/2;
+    
+    //convolve
+    for(i=fheight; i<m1.height-fheight; i++) {
+        for(j=fwidth; j<m1.width-fwidth; j++) {
+            double sum= 0.0;
+            for(x=0; x<m2.height; x++) {
+                for(y=0; y<m2.width; y++) {
+                    sum+=m1.map[i-fheight+x][j-fwidth+y]*m2.map[x][y];
+                }
+            }
+            res.map[i][j]=sum;
+        }
+    }
+    return res;
+}
+
+//funct to compute rows first..first+count-1 of a ground truth edge map from an intensity channel
+//output row y goes to out[y-first]
+void groundTruthRows(ChannelView img, int first, int count, Pixel **out) {
+    //compute gradients using sobel filters - 16-bit integer convolution, borders are 0
+    ShortMatrix gx=createShortMatrix(count, img.width);
+    ShortMatrix gy=createShortMatrix(count, img.width);
+    convolveChannelRows(img, sobelXKernel(), first, count, gx.map);
+    convolveChannelRows(img, sobelYKernel(), first, count, gy.map);
 
-    //init edge map to black
-    for(int y =0; y < edgeMap.height; y++) {
-        for(int x=0; x < edgeMap.width; x++) {
-            edgeMap.map[y][x].i=0;  //black background
+    for(int y=0; y<count; y++) {
+        Pixel *dst=out[y];
+        for(int x=0; x<img.width; x++) {
+            int gradientMagnitude = (int)sqrt(gx.map[y][x] * gx.map[y][x] + gy.map[y][x] * gy.map[y][x]);
+
+            //threshold the gradient magnitude - mark as edge white, black background elsewhere
+            dst[x].r=dst[x].g=dst[x].b=255;
+            dst[x].i=gradientMagnitude>128? 255 : 0;
         }
     }
+    deleteShortMatrix(gx);
+    deleteShortMatrix(gy);
+}
+
+//funct to generate a ground truth edge map from the intensity channel of an input image
+Image generateGroundTruth(ChannelView img) {
+    Image edgeMap=createImage(img.height, img.width);
+    groundTruthRows(img, 0, img.height, edgeMap.map);
+    return edgeMap;
+}
+
+//funct to generate a ground truth edge map band by band, so only bandRows rows plus halo are in memory
+void generateGroundTruthStreaming(char *inputFile, char *outputFile, int bandRows) {
+    ImageReader reader=openImageReader(inputFile, bandRows, 1);
+    ImageWriter writer=openImageWriter(outputFile, reader.height, reader.width);
+    Image edgeMap=createImage(bandRows, reader.width);
+
+    while(readBand(&reader)>0) {
+        groundTruthRows(intensityView(reader.band), reader.first-reader.top, reader.count, edgeMap.map);
+        writeRows(&writer, edgeMap, 0, reader.count);
+    }
 
-    //apply edge detection based on intensity differences
-    for(int y = 1; y < img.height - 1; y++) {
-        for(int x = 1; x < img.width - 1; x++) {
-            //compute gradient magnitude using sobel-like filters
-            int gx = img.map[y-1][x+1].i-img.map[y-1][x-1].i +
-                     2 * img.map[y][x+1].i-2*img.map[y][x-1].i +
-                     img.map[y+1][x+1].i-img.map[y+1][x-1].i;
+    closeImageReader(reader);
+    closeImageWriter(writer);
+    deleteImage(edgeMap);
+}
+
+//funct to check the 16-bit integer convolution against convolve on doubles bit for bit
+//covers the specialized sobel and binomial kernels and the generic 3x3 and 5x5 ones, on the intensity
+//plane and on the interleaved intensity of an image, with 1, 16 and all rows computed per call
+//returns the number of entries that differ
+int checkIntegerConvolution(char *inputFile) {
+    int weights[5][25]={
+        {-1,0,1, -2,0,2, -1,0,1},                       //sobel x
+        {-1,-2,-1, 0,0,0, 1,2,1},                       //sobel y
+        {1,2,1, 2,4,2, 1,2,1},                          //binomial
+        {0,-1,0, -1,5,-1, 0,-1,0},                      //sharpen - generic 3x3
+        {0,0,-1,0,0, 0,-1,-2,-1,0, -1,-2,16,-2,-1, 0,-1,-2,-1,0, 0,0,-1,0,0} //laplacian of gaussian - generic 5x5
+    };
+    int sizes[5]={3, 3, 3, 3, 5};
 
-            int gy = img.map[y-1][x-1].i+ 2 *img.map[y-1][x].i+img.map[y-1][x+1].i -
-                     img.map[y+1][x-1].i - 2*img.map[y+1][x].i-img.map[y+1][x+1].i;
+    Image img=readImage(inputFile);
+    PlanarImage planar=image2Planar(img, 0);
+    ChannelView views[2]={planeView(planar, planar.i), intensityView(img)};
+    Matrix img_matrix=channel2Matrix(views[0]);
+    ShortMatrix out=createShortMatrix(img.height, img.width);
 
-            int gradientMagnitude = (int)sqrt(gx * gx + gy * gy);
+    int differences=0;
+    for(int k=0; k<5; k++) {
+        double entries[25];
+        for(int i=0; i<sizes[k]*sizes[k]; i++)
+            entries[i]=weights[k][i];
+        Matrix kernel=createMatrixFromArray(entries, sizes[k], sizes[k]);
+        Matrix res=convolve(img_matrix, kernel);
+        IntKernel intKernel=createIntKernel(weights[k], sizes[k], 0);
 
-            //threshold the gradient magnitude
-            if(gradientMagnitude>128) {
-                edgeMap.map[y][x].i = 255;  //mark as edge - white
+        for(int v=0; v<2; v++) {
+            int bands[3]={1, 16, img.height};
+            for(int b=0; b<3; b++) {
+                for(int first=0; first<img.height; first+=bands[b])
+                    convolveChannelRows(views[v], intKernel, first, MIN(bands[b], img.height-first), out.map+first);
+                for(int i=0; i<img.height; i++)
+                    for(int j=0; j<img.width; j++)
+                        differences+=out.map[i][j]!=res.map[i][j];
             }
         }
+        deleteMatrix(kernel);
+        deleteMatrix(res);
     }
 
-    return edgeMap;
+    deleteImage(img);
+    deletePlanarImage(planar);
+    deleteMatrix(img_matrix);
+    deleteShortMatrix(out);
+    return differences;
 }
 
 int main(int argc, char **argv) {
     char *inputFile=argv[1];
     char *outputFile=argv[2];
-    Image inputImage=readImage(inputFile);
+    int bandRows=0; //0 - process the whole frame at once
+
+    for(int a=3; a<argc; a++) {
+        if(strcmp(argv[a], "-band")==0 && a+1<argc)
+            bandRows=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-check")==0) {
+            int differences=checkIntegerConvolution(inputFile);
+            printf("Integer convolution: %d entries differ from the double convolution\n", differences);
+            if(differences>0)
+                return 1;
+        }
+    }
+
+    if(bandRows>0) {
+        generateGroundTruthStreaming(inputFile, outputFile, bandRows);
+        printf("Ground truth edge map saved to %s\n", outputFile);
+        return 0;
+    }
+
+    //only the intensity plane is loaded - 8-bit grayscale files are used straight from the file mapping
+    PlanarImage inputImage=readPlanarImage(inputFile, 0);
+    ChannelView src=planeView(inputImage, inputImage.i);
 
     //generate ground truth edge map
-    Image groundTruth=generateGroundTruth(inputImage);
+    Image groundTruth=generateGroundTruth(src);
     writeImage(groundTruth, outputFile);
 
     //clean up
-    deleteImage(inputImage);
+    deletePlanarImage(inputImage);
     deleteImage(groundTruth);
 
     printf("Ground truth edge map saved to %s\n", outputFile);
@@ -2,141 +2,682 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define MAX_RADIUS 100  //max radius for circle detection
 #define MIN_RADIUS 20   //min radius for circle detection
 #define THRESHOLD_SCALE 0.6  //scale for dynamic threshold
 #define THETA_STEP 10   //step size for theta in degrees
+#define MAX_SPREAD 45   //max angular spread around the gradient direction in degrees
+#define NEIGHBORHOOD 10 //default half size in x, y and radius of the neighborhood in which a circle must have the most votes
 
+//ways to vote - every THETA_STEP degrees around each edge pixel, or only along its gradient
+typedef enum {EXHAUSTIVE, DIRECTED} VotingMode;
+const char *votingModeNames[]={"exhaustive", "directed"};
+
+//vote counter of one hough cell - in exhaustive mode, for a given cell, radius and angle there is exactly one
+//edge position that votes for it, so a cell gets at most 360/THETA_STEP votes; in directed mode each edge pixel
+//votes at most once per cell and only the pixels about r away from it can vote, a few times r of them;
+//either way 16 bits are plenty
+typedef unsigned short HoughCount;
+
+//the accumulator is one contiguous block laid out radius-major: one height x width plane per radius
+//from minRadius to maxRadius-1, so voting for a radius and scanning the space are sequential streams
+//a window holds fewer planes than radii and reuses them as a ring - radius r is in plane (r-origin)%planes -
+//for one band of radii at a time
 typedef struct {
-    int ***votes;
+    HoughCount *votes;
     int height;
     int width;
+    int minRadius;
     int maxRadius;
+    size_t plane; //cells per radius plane
+    int planes;   //radius planes held
+    int origin;   //radius in plane 0
 } HoughSpace;
 
-HoughSpace createHoughSpace(int height, int width, int maxRadius);
+//edge pixel position, collected once so that each radius plane is voted for in one go,
+//and the direction of the intensity gradient there as an angle in radians for directed voting
+typedef struct {
+    int y, x;
+    double direction;
+} EdgePixel;
+
+//integer offsets (dx,dy)=((int)(r*cos(theta)), (int)(r*sin(theta))) of the points of a circle of radius r every
+//THETA_STEP degrees, for all radii minRadius..maxRadius-1; the offsets of radius r are entries first[r-minRadius]
+//to first[r-minRadius+1]-1, with duplicates removed so that each cell of a circle is visited once
+typedef struct {
+    int minRadius;
+    int maxRadius;
+    int *first;
+    int *dx, *dy;
+} CircleOffsets;
+
+//a detected circle and the votes for it
+typedef struct {
+    int y, x, radius, votes;
+} Circle;
+
+//how circles are picked from the hough space: only cells above the threshold that have the most votes within
+//neighborhood cells in x and y and radiusNeighborhood radii count - with both 0, every cell above the threshold
+//does - and of those the topK with the most votes (0 - all)
+typedef struct {
+    int neighborhood;
+    int radiusNeighborhood;
+    int topK;
+} CircleSelection;
+
+//the edge pixels and how they vote
+typedef struct {
+    VotingMode mode;
+    EdgePixel *pixels;
+    int count;
+    CircleOffsets offsets; //exhaustive mode
+    int spread;            //directed mode
+} HoughVoter;
+
+CircleOffsets createCircleOffsets(int minRadius, int maxRadius);
+void freeCircleOffsets(CircleOffsets offsets);
+HoughSpace createHoughSpace(int height, int width, int minRadius, int maxRadius);
+HoughSpace createHoughWindow(int height, int width, int minRadius, int maxRadius, int planes);
 void freeHoughSpace(HoughSpace hough);
-void houghTransformCircles(Image edgeImage, HoughSpace *hough);
-void findHoughMaxima(HoughSpace hough, Image edgeImage, Image houghMaxima);
-void markDetectedCircles(Image img, int yCenter, int xCenter, int radius);
-void writeHoughSpaceAsImage(HoughSpace hough, const char *filename);
+HoughCount *houghPlane(HoughSpace hough, int r);
+HoughSpace houghRadii(HoughSpace hough, int minRadius, int maxRadius);
+int collectEdgePixels(Image edgeImage, EdgePixel **pixels);
+HoughVoter createHoughVoter(Image edgeImage, VotingMode mode, CircleOffsets offsets, ChannelView *source, int spread);
+void freeHoughVoter(HoughVoter voter);
+void houghTransformCircles(HoughVoter voter, HoughSpace *hough, int threads);
+int maxHoughVotes(HoughSpace hough, int threads);
+void sumHoughVotes(HoughSpace hough, int *totals, int threads);
+int findHoughCircles(HoughSpace hough, int threshold, CircleSelection selection, Circle **circles, int threads);
+Circle *findHoughMaxima(HoughSpace hough, CircleSelection selection, int *count, int threads);
+Circle *findHoughMaximaBanded(HoughVoter voter, int height, int width, int minRadius, int maxRadius, int band,
+                              CircleSelection selection, const char *debugFilename, int *count, int threads);
+void markCircles(const Circle *circles, int count, CircleOffsets offsets, Image edgeImage, Image houghMaxima);
+void writeCircles(const Circle *circles, int count, const char *filename);
+void markDetectedCircles(Image img, CircleOffsets offsets, int yCenter, int xCenter, int radius);
+void writeVoteTotalsAsImage(const int *totals, int height, int width, int maxVotes, const char *filename);
+void writeHoughSpaceAsImage(HoughSpace hough, const char *filename, int threads);
+
+//funct to build the circle offset tables for radii minRadius..maxRadius-1
+//the trigonometry runs here once; voting and drawing only add offsets
+CircleOffsets createCircleOffsets(int minRadius, int maxRadius) {
+    CircleOffsets offsets;
+    int radii=MAX(maxRadius-minRadius, 0), steps=(360+THETA_STEP-1)/THETA_STEP;
+    offsets.minRadius=minRadius;
+    offsets.maxRadius=maxRadius;
+    offsets.first=(int *)malloc(sizeof(int)*(radii+1));
+    offsets.dx=(int *)malloc(sizeof(int)*MAX(radii*steps, 1));
+    offsets.dy=(int *)malloc(sizeof(int)*MAX(radii*steps, 1));
+
+    int n=0;
+    for(int r=minRadius; r<maxRadius; r++) {
+        offsets.first[r-minRadius]=n;
+        for(int theta=0; theta<360; theta+=THETA_STEP) {
+            int dx=(int)(r*cos(theta*M_PI/180.0));
+            int dy=(int)(r*sin(theta*M_PI/180.0));
+            int seen=0;
+            for(int k=offsets.first[r-minRadius]; k<n && !seen; k++)
+                seen=offsets.dx[k]==dx && offsets.dy[k]==dy;
+            if(!seen) {
+                offsets.dx[n]=dx;
+                offsets.dy[n]=dy;
+                n++;
+            }
+        }
+    }
+    offsets.first[radii]=n;
+    return offsets;
+}
 
-//funct to create 3D hough space for circle detection
-HoughSpace createHoughSpace(int height, int width, int maxRadius) {
+void freeCircleOffsets(CircleOffsets offsets) {
+    free(offsets.first);
+    free(offsets.dx);
+    free(offsets.dy);
+}
+
+//funct to create 3D hough space for circle detection with radii minRadius..maxRadius-1
+HoughSpace createHoughSpace(int height, int width, int minRadius, int maxRadius) {
+    return createHoughWindow(height, width, minRadius, maxRadius, maxRadius-minRadius);
+}
+
+//funct to create a hough space for radii minRadius..maxRadius-1 that holds only the given number of planes
+//all counters are allocated - zeroed - in one call
+HoughSpace createHoughWindow(int height, int width, int minRadius, int maxRadius, int planes) {
     HoughSpace hough;
     hough.height=height;
     hough.width=width;
+    hough.minRadius=minRadius;
     hough.maxRadius=maxRadius;
+    hough.plane=(size_t)height*width;
+    hough.planes=MAX(planes, 1);
+    hough.origin=minRadius;
 
-    hough.votes=(int ***)malloc(height * sizeof(int **));
-    for(int i=0; i<height; i++) {
-        hough.votes[i]=(int **)malloc(width * sizeof(int *));
-        for(int j=0; j<width; j++) {
-            hough.votes[i][j]=(int *)calloc(maxRadius, sizeof(int));
-        }
+    hough.votes=(HoughCount *)calloc(hough.plane*hough.planes, sizeof(HoughCount));
+    if(hough.votes==NULL) {
+        fprintf(stderr, "Out of memory for the hough space.\n");
+        exit(1);
     }
     return hough;
 }
 
 void freeHoughSpace(HoughSpace hough) {
-    for(int i=0; i<hough.height; i++) {
-        for(int j=0; j<hough.width; j++) {
-            free(hough.votes[i][j]);
-        }
-        free(hough.votes[i]);
-    }
     free(hough.votes);
 }
 
-//perform Hough Transform for circles on an edge image
-void houghTransformCircles(Image edgeImage, HoughSpace *hough) {
-    printf("Performing Hough Transform...\n");
+//funct to get the vote plane of radius r - the votes for center (y,x) are at [y*width+x]
+HoughCount *houghPlane(HoughSpace hough, int r) {
+    return hough.votes+(size_t)((r-hough.origin)%hough.planes)*hough.plane;
+}
 
+//funct to view radii minRadius..maxRadius-1 of a hough space, for voting, scanning or searching only those
+HoughSpace houghRadii(HoughSpace hough, int minRadius, int maxRadius) {
+    hough.minRadius=minRadius;
+    hough.maxRadius=maxRadius;
+    return hough;
+}
+
+//funct to collect the positions of all edge pixels in raster order
+//returns their number; the list must be freed by the caller
+int collectEdgePixels(Image edgeImage, EdgePixel **pixels) {
+    int count=0;
     for(int y=0; y<edgeImage.height; y++) {
         for(int x=0; x<edgeImage.width; x++) {
-            if(edgeImage.map[y][x].i>200) {  //edge pixel - threshold
-                for(int r=MIN_RADIUS; r<hough->maxRadius; r++) {
-                    for(int theta=0; theta<360; theta+=THETA_STEP) {
-                        int x0=x-(int)(r*cos(theta*M_PI/180.0));
-                        int y0=y-(int)(r*sin(theta*M_PI/180.0));
-                        if(x0>=0 && x0<hough->width && y0>=0 && y0<hough->height) {
-                            hough->votes[y0][x0][r]++;
-                        }
-                    }
+            count+=edgeImage.map[y][x].i>200; //edge pixel - threshold
+        }
+    }
+
+    *pixels=(EdgePixel *)malloc(sizeof(EdgePixel)*MAX(count, 1));
+    count=0;
+    for(int y=0; y<edgeImage.height; y++) {
+        for(int x=0; x<edgeImage.width; x++) {
+            if(edgeImage.map[y][x].i>200) {
+                (*pixels)[count].y=y;
+                (*pixels)[count].x=x;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+//shared state of parallel voting: every task votes for its own radius planes, so no two threads ever
+//write the same counter and the planes need no merging afterwards
+typedef struct {
+    HoughSpace *hough;
+    CircleOffsets offsets;
+    const EdgePixel *pixels;
+    int count;
+    int spread; //directed mode
+    int radiiPerTask;
+} HoughVoting;
+
+//funct to vote for the plane of one radius, task k being radius minRadius+k
+//the circle points come from the offset tables, and for edge pixels at least r away from the border
+//all of them are inside, so the bounds checks are skipped
+static void voteRadius(void *arg, int k) {
+    HoughVoting *v=(HoughVoting *)arg;
+    int width=v->hough->width, height=v->hough->height, r=v->hough->minRadius+k;
+    HoughCount *votes=houghPlane(*v->hough, r);
+    int first=v->offsets.first[r-v->offsets.minRadius], last=v->offsets.first[r-v->offsets.minRadius+1];
+    const int *dx=v->offsets.dx+first, *dy=v->offsets.dy+first;
+    int n=last-first;
+
+    ptrdiff_t *cellOffsets=(ptrdiff_t *)malloc(sizeof(ptrdiff_t)*MAX(n, 1));
+    for(int o=0; o<n; o++)
+        cellOffsets[o]=(ptrdiff_t)dy[o]*width+dx[o];
+
+    for(int p=0; p<v->count; p++) {
+        int x=v->pixels[p].x, y=v->pixels[p].y;
+        if(x>=r && x<width-r && y>=r && y<height-r) {
+            HoughCount *center=votes+(size_t)y*width+x;
+            for(int o=0; o<n; o++)
+                center[-cellOffsets[o]]++;
+        } else {
+            for(int o=0; o<n; o++) {
+                int x0=x-dx[o];
+                int y0=y-dy[o];
+                if(x0>=0 && x0<width && y0>=0 && y0<height) {
+                    votes[(size_t)y0*width+x0]++;
                 }
             }
         }
     }
-    printf("Hough Transform completed.\n");
+    free(cellOffsets);
 }
 
-//write Hough space as an image for debugging
-void writeHoughSpaceAsImage(HoughSpace hough, const char *filename) {
-    Image houghImage=createImage(hough.height, hough.width);
-    int maxVotes=0;
-    //find max votes
-    for(int y=0; y<hough.height; y++) {
-        for(int x=0; x<hough.width; x++) {
-            for(int r=MIN_RADIUS; r<hough.maxRadius; r++) {
-                if(hough.votes[y][x][r]>maxVotes) {
-                    maxVotes=hough.votes[y][x][r];
+//funct for directed voting into the planes of radii minRadius+k*radiiPerTask onwards
+//directed votes are few and scattered, so unlike in exhaustive mode the radius is the inner loop,
+//which takes the trigonometry out of it
+static void voteDirectedRadii(void *arg, int k) {
+    HoughVoting *v=(HoughVoting *)arg;
+    HoughSpace *hough=v->hough;
+    int rFirst=hough->minRadius+k*v->radiiPerTask, rLast=MIN(rFirst+v->radiiPerTask, hough->maxRadius);
+
+    //unit vectors of the voting directions of one pixel, and the cells it voted for at the current radius
+    int angles=2*(2*v->spread+1);
+    double *c=(double *)malloc(sizeof(double)*angles), *sn=(double *)malloc(sizeof(double)*angles);
+    size_t *voted=(size_t *)malloc(sizeof(size_t)*angles);
+
+    for(int p=0; p<v->count; p++) {
+        int x=v->pixels[p].x, y=v->pixels[p].y;
+        for(int a=0; a<angles; a++) {
+            double theta=v->pixels[p].direction + (a%2)*M_PI + (a/2-v->spread)*M_PI/180.0;
+            c[a]=cos(theta);
+            sn[a]=sin(theta);
+        }
+        for(int r=rFirst; r<rLast; r++) {
+            HoughCount *votes=houghPlane(*hough, r);
+            int n=0;
+            for(int a=0; a<angles; a++) {
+                int x0=x-(int)(r*c[a]);
+                int y0=y-(int)(r*sn[a]);
+                if(x0<0 || x0>=hough->width || y0<0 || y0>=hough->height)
+                    continue;
+                size_t cell=(size_t)y0*hough->width+x0;
+                int seen=0; //neighbouring angles often land in the same cell, which gets only one vote
+                for(int u=0; u<n && !seen; u++)
+                    seen=voted[u]==cell;
+                if(!seen) {
+                    voted[n++]=cell;
+                    votes[cell]++;
                 }
             }
         }
     }
 
+    free(c);
+    free(sn);
+    free(voted);
+}
+
+//funct to collect the edge pixels of an edge image that vote, and how
+//in directed mode the center of a circle through an edge pixel lies along the intensity gradient there - in front
+//of or behind it, depending on whether the circle is brighter or darker than its surroundings - so each edge pixel
+//votes at both sides of each radius, within spread degrees of the gradient direction, instead of all around;
+//the gradients come from sobel on the source image of the edge map, and pixels without gradient don't vote
+HoughVoter createHoughVoter(Image edgeImage, VotingMode mode, CircleOffsets offsets, ChannelView *source, int spread) {
+    HoughVoter voter={mode, NULL, 0, offsets, spread};
+    voter.count=collectEdgePixels(edgeImage, &voter.pixels);
+    if(mode!=DIRECTED)
+        return voter;
+
+    ShortMatrix gradx=convolveChannel(*source, sobelXKernel());
+    ShortMatrix grady=convolveChannel(*source, sobelYKernel());
+    int directed=0;
+    for(int k=0; k<voter.count; k++) {
+        int gx=gradx.map[voter.pixels[k].y][voter.pixels[k].x], gy=grady.map[voter.pixels[k].y][voter.pixels[k].x];
+        if(gx!=0 || gy!=0) {
+            voter.pixels[directed]=voter.pixels[k];
+            voter.pixels[directed].direction=atan2(gy, gx);
+            directed++;
+        }
+    }
+    deleteShortMatrix(gradx);
+    deleteShortMatrix(grady);
+
+    printf("%d of %d edge pixels have a gradient.\n", directed, voter.count);
+    voter.count=directed;
+    return voter;
+}
+
+void freeHoughVoter(HoughVoter voter) {
+    free(voter.pixels);
+}
+
+//perform Hough Transform for circles into radii minRadius..maxRadius-1 of the hough space with the given
+//number of threads (0 - one per processor)
+//exhaustive votes go radius by radius, so that all votes of a radius go to the same plane; directed ones are
+//split into a few slices of radii per thread, each task redoing the trigonometry
+void houghTransformCircles(HoughVoter voter, HoughSpace *hough, int threads) {
+    int radii=hough->maxRadius-hough->minRadius;
+    HoughVoting v={hough, voter.offsets, voter.pixels, voter.count, voter.spread, 1};
+
+    if(voter.mode==DIRECTED) {
+        int slices=MIN(radii, 4*(threads>0 ? threads : processorCount()));
+        if(slices>0) {
+            v.radiiPerTask=(radii+slices-1)/slices;
+            parallelFor((radii+v.radiiPerTask-1)/v.radiiPerTask, threads, voteDirectedRadii, &v);
+        }
+    } else
+        parallelFor(radii, threads, voteRadius, &v);
+}
+
+//shared state of the parallel scans of the hough space
+typedef struct {
+    HoughSpace hough;
+    int *maxima; //largest count per radius plane
+    int *totals; //votes per center summed over the radii, NULL - not needed
+    int bandRows;
+} HoughScan;
+
+//funct to find the largest count of radius plane minRadius+k
+static void planeMaximum(void *arg, int k) {
+    HoughScan *s=(HoughScan *)arg;
+    const HoughCount *votes=houghPlane(s->hough, s->hough.minRadius+k);
+    HoughCount maxVotes=0;
+    for(size_t c=0; c<s->hough.plane; c++)
+        maxVotes=MAX(maxVotes, votes[c]);
+    s->maxima[k]=maxVotes;
+}
+
+//funct to add the votes over the radii to the totals of the centers in band k of bandRows rows
+//plane by plane, so the inner loop is a vectorizable add of two rows
+static void sumBand(void *arg, int k) {
+    HoughScan *s=(HoughScan *)arg;
+    size_t first=(size_t)k*s->bandRows*s->hough.width;
+    size_t last=MIN(first+(size_t)s->bandRows*s->hough.width, s->hough.plane);
+    int *totals=s->totals;
+
+    for(int r=s->hough.minRadius; r<s->hough.maxRadius; r++) {
+        const HoughCount *votes=houghPlane(s->hough, r);
+        for(size_t c=first; c<last; c++)
+            totals[c]+=votes[c];
+    }
+}
+
+//funct to find the largest vote count in the hough space with the given number of threads
+int maxHoughVotes(HoughSpace hough, int threads) {
+    int radii=hough.maxRadius-hough.minRadius, maxVotes=0;
+    HoughScan s={hough, (int *)calloc(MAX(radii, 1), sizeof(int)), NULL, 0};
+
+    parallelFor(radii, threads, planeMaximum, &s);
+    for(int k=0; k<radii; k++)
+        maxVotes=MAX(maxVotes, s.maxima[k]);
+    free(s.maxima);
+    return maxVotes;
+}
+
+//funct to add the votes of each center over the radii of the hough space to totals, in bands of rows
+void sumHoughVotes(HoughSpace hough, int *totals, int threads) {
+    HoughScan s={hough, NULL, totals, 64};
+    parallelFor((hough.height+s.bandRows-1)/s.bandRows, threads, sumBand, &s);
+}
+
+//write the votes per center summed over all radii as an image for debugging
+void writeVoteTotalsAsImage(const int *totals, int height, int width, int maxVotes, const char *filename) {
+    Image houghImage=createImage(height, width);
+
     //normalize votes into a grayscale image
-    for(int y=0; y<hough.height; y++) {
-        for(int x=0; x<hough.width; x++) {
-            int totalVotes=0;
-            for(int r=MIN_RADIUS; r<hough.maxRadius; r++) {
-                totalVotes+=hough.votes[y][x][r];
-            }
-            houghImage.map[y][x].i=(int)(255.0*totalVotes/ maxVotes);
+    for(int y=0; y<height; y++) {
+        for(int x=0; x<width; x++) {
+            houghImage.map[y][x].i=(int)(255.0*totals[(size_t)y*width+x]/ maxVotes);
         }
     }
-    writeImage(houghImage, filename);
+    writeImage(houghImage, (char *)filename);
     deleteImage(houghImage);
 }
 
-//find maxima in Hough space and mark detected circles
-void findHoughMaxima(HoughSpace hough, Image edgeImage, Image houghMaxima) {
-    int maxVotes=0;
+//write Hough space as an image for debugging
+void writeHoughSpaceAsImage(HoughSpace hough, const char *filename, int threads) {
+    int *totals=(int *)calloc(MAX(hough.plane, 1), sizeof(int));
+    sumHoughVotes(hough, totals, threads);
+    writeVoteTotalsAsImage(totals, hough.height, hough.width, maxHoughVotes(hough, threads), filename);
+    free(totals);
+}
 
-    //find max votes in the hough space
-    for(int y=0; y<hough.height; y++) {
-        for(int x=0; x<hough.width; x++) {
-            for(int r=MIN_RADIUS; r<hough.maxRadius; r++) {
-                if(hough.votes[y][x][r]>maxVotes) {
-                    maxVotes=hough.votes[y][x][r];
-                }
+//shared state of the search for circles; every radius plane collects its own candidates
+typedef struct {
+    HoughSpace hough;
+    int first; //radius of the first plane searched
+    int threshold;
+    CircleSelection selection;
+    Circle **found; //per plane
+    int *count, *capacity;
+} CircleSearch;
+
+//funct to check whether cell (y,x,r) has the most votes in its neighborhood
+//ties go to the cell that comes first in (radius, y, x) order, so a plateau yields one circle;
+//radii outside the hough space are left out
+static int isLocalMaximum(HoughSpace hough, CircleSelection selection, int y, int x, int r) {
+    int v=houghPlane(hough, r)[(size_t)y*hough.width+x];
+    int r0=MAX(r-selection.radiusNeighborhood, hough.minRadius), r1=MIN(r+selection.radiusNeighborhood, hough.maxRadius-1);
+    int y0=MAX(y-selection.neighborhood, 0), y1=MIN(y+selection.neighborhood, hough.height-1);
+    int x0=MAX(x-selection.neighborhood, 0), x1=MIN(x+selection.neighborhood, hough.width-1);
+
+    for(int rr=r0; rr<=r1; rr++) {
+        const HoughCount *votes=houghPlane(hough, rr);
+        for(int yy=y0; yy<=y1; yy++) {
+            const HoughCount *row=votes+(size_t)yy*hough.width;
+            for(int xx=x0; xx<=x1; xx++) {
+                int before=rr<r || (rr==r && (yy<y || (yy==y && xx<x)));
+                if(row[xx]>v || (before && row[xx]==v))
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+//funct to collect the local maxima above the threshold in radius plane first+k
+static void searchPlane(void *arg, int k) {
+    CircleSearch *s=(CircleSearch *)arg;
+    int r=s->first+k, width=s->hough.width;
+    const HoughCount *votes=houghPlane(s->hough, r);
+
+    for(int y=0; y<s->hough.height; y++) {
+        for(int x=0; x<width; x++) {
+            if(votes[(size_t)y*width+x]<=s->threshold || !isLocalMaximum(s->hough, s->selection, y, x, r))
+                continue;
+            if(s->count[k]==s->capacity[k]) {
+                s->capacity[k]=MAX(2*s->capacity[k], 16);
+                s->found[k]=(Circle *)realloc(s->found[k], sizeof(Circle)*s->capacity[k]);
             }
+            Circle c={y, x, r, votes[(size_t)y*width+x]};
+            s->found[k][s->count[k]++]=c;
         }
     }
+}
+
+//funct to order circles: more votes first, ties in (radius, y, x) order so that results are deterministic
+static int strongerCircle(Circle a, Circle b) {
+    if(a.votes!=b.votes)
+        return a.votes>b.votes;
+    if(a.radius!=b.radius)
+        return a.radius<b.radius;
+    return a.y!=b.y ? a.y<b.y : a.x<b.x;
+}
+
+//funct to restore the heap order below entry i of a heap of n circles whose root is the weakest
+static void siftDown(Circle *heap, int n, int i) {
+    for(;;) {
+        int weakest=i, l=2*i+1, r=2*i+2;
+        if(l<n && strongerCircle(heap[weakest], heap[l]))
+            weakest=l;
+        if(r<n && strongerCircle(heap[weakest], heap[r]))
+            weakest=r;
+        if(weakest==i)
+            return;
+        Circle t=heap[i]; heap[i]=heap[weakest]; heap[weakest]=t;
+        i=weakest;
+    }
+}
+
+//funct to collect the local maxima with more than threshold votes at radii first..last-1 of the hough space
+//the planes are searched in parallel, their neighborhoods may reach any radius of the hough space
+//returns their number and stores them in *candidates, in (radius, y, x) order; the caller must free them
+static int collectCandidates(HoughSpace hough, int first, int last, int threshold, CircleSelection selection,
+                             Circle **candidates, int threads) {
+    int radii=MAX(last-first, 0);
+    CircleSearch s={hough, first, threshold, selection, (Circle **)calloc(MAX(radii, 1), sizeof(Circle *)),
+                    (int *)calloc(MAX(radii, 1), sizeof(int)), (int *)calloc(MAX(radii, 1), sizeof(int))};
+    parallelFor(radii, threads, searchPlane, &s);
+
+    int total=0;
+    for(int k=0; k<radii; k++)
+        total+=s.count[k];
+    *candidates=(Circle *)malloc(sizeof(Circle)*MAX(total, 1));
+    total=0;
+    for(int k=0; k<radii; k++) {
+        if(s.count[k]>0)
+            memcpy(*candidates+total, s.found[k], sizeof(Circle)*s.count[k]);
+        total+=s.count[k];
+        free(s.found[k]);
+    }
+
+    free(s.found);
+    free(s.count);
+    free(s.capacity);
+    return total;
+}
+
+//funct to pick the topK (0 - all) strongest of the candidates with more than threshold votes with a heap
+//returns their number and stores them, strongest first, in *circles, which the caller must free
+static int selectCircles(const Circle *candidates, int count, int threshold, int topK, Circle **circles) {
+    int above=0;
+    for(int i=0; i<count; i++)
+        above+=candidates[i].votes>threshold;
+    int keep=topK>0 ? MIN(topK, above) : above;
+
+    //min-heap of the keep strongest circles so far, its root the weakest of them
+    Circle *heap=(Circle *)malloc(sizeof(Circle)*MAX(keep, 1));
+    int n=0;
+    for(int i=0; i<count; i++) {
+        Circle c=candidates[i];
+        if(c.votes<=threshold)
+            continue;
+        if(n<keep) {
+            heap[n++]=c;
+            if(n==keep) {
+                for(int j=n/2-1; j>=0; j--)
+                    siftDown(heap, n, j);
+            }
+        } else if(keep>0 && strongerCircle(c, heap[0])) {
+            heap[0]=c;
+            siftDown(heap, n, 0);
+        }
+    }
+
+    //heap sort: repeatedly move the weakest to the end, which leaves the strongest first
+    for(int j=n/2-1; j>=0; j--)
+        siftDown(heap, n, j);
+    for(int end=n-1; end>0; end--) {
+        Circle t=heap[0]; heap[0]=heap[end]; heap[end]=t;
+        siftDown(heap, end, 0);
+    }
+
+    *circles=heap;
+    return n;
+}
+
+//funct to find the circles in the hough space: local maxima with more than threshold votes, see CircleSelection
+//returns their number and stores them, strongest first, in *circles, which the caller must free
+int findHoughCircles(HoughSpace hough, int threshold, CircleSelection selection, Circle **circles, int threads) {
+    Circle *candidates;
+    int count=collectCandidates(hough, hough.minRadius, hough.maxRadius, threshold, selection, &candidates, threads);
+    count=selectCircles(candidates, count, threshold, selection.topK, circles);
+    free(candidates);
+    return count;
+}
+
+//find maxima in Hough space
+//returns the circles, strongest first, and their number in *count; the caller must free them
+Circle *findHoughMaxima(HoughSpace hough, CircleSelection selection, int *count, int threads) {
+    //find max votes in the hough space
+    int maxVotes=maxHoughVotes(hough, threads);
 
     //set a dynamic threshold
     int dynamicThreshold=(int)(maxVotes* THRESHOLD_SCALE);
     printf("Max Votes: %d, Dynamic Threshold: %d\n", maxVotes, dynamicThreshold);
 
-    //detect and mark circles based on the dynamic threshold
-    for(int y= 0; y<hough.height; y++) {
-        for(int x=0; x<hough.width; x++) {
-            for(int r=MIN_RADIUS; r<hough.maxRadius; r++) {
-                if(hough.votes[y][x][r]>dynamicThreshold) {
-                    markDetectedCircles(edgeImage, y, x, r);
-                    houghMaxima.map[y][x].i = 255; //mark maxima
-                }
-            }
+    Circle *circles;
+    *count=findHoughCircles(hough, dynamicThreshold, selection, &circles, threads);
+    printf("Circles found: %d\n", *count);
+    return circles;
+}
+
+//find maxima in Hough space band by band of radii, for when the whole hough space doesn't fit in memory
+//only band+2*radiusNeighborhood planes are held, as a ring: the planes are voted for as the search gets to
+//them, and the circles of a band are searched once the neighborhoods of its radii are all in; the max votes
+//only grow as planes come in, so candidates above the running threshold are kept and filtered by the final
+//one, which gives the same circles as the whole hough space
+//the votes per center are summed on the way for the debug image
+//returns the circles, strongest first, and their number in *count; the caller must free them
+Circle *findHoughMaximaBanded(HoughVoter voter, int height, int width, int minRadius, int maxRadius, int band,
+                              CircleSelection selection, const char *debugFilename, int *count, int threads) {
+    int reach=selection.radiusNeighborhood;
+    HoughSpace window=createHoughWindow(height, width, minRadius, maxRadius, MIN(band+2*reach, maxRadius-minRadius));
+    int *totals=(int *)calloc(MAX(window.plane, 1), sizeof(int));
+    Circle *candidates=NULL;
+    int candidateCount=0, maxVotes=0;
+    printf("Performing Hough Transform in bands of %d radii (%d planes)...\n", band, window.planes);
+
+    //radii below voted have their planes in the window
+    int voted=minRadius;
+    for(int first=minRadius; first<maxRadius; first+=band) {
+        int last=MIN(first+band, maxRadius), need=MIN(last+reach, maxRadius);
+
+        //the new planes take the place of those no longer in any neighborhood
+        for(int r=voted; r<need; r++)
+            memset(houghPlane(window, r), 0, sizeof(HoughCount)*window.plane);
+        HoughSpace fresh=houghRadii(window, voted, need);
+        houghTransformCircles(voter, &fresh, threads);
+        maxVotes=MAX(maxVotes, maxHoughVotes(fresh, threads));
+        sumHoughVotes(fresh, totals, threads);
+        voted=need;
+
+        Circle *found;
+        int n=collectCandidates(window, first, last, (int)(maxVotes* THRESHOLD_SCALE), selection, &found, threads);
+        candidates=(Circle *)realloc(candidates, sizeof(Circle)*MAX(candidateCount+n, 1));
+        memcpy(candidates+candidateCount, found, sizeof(Circle)*n);
+        candidateCount+=n;
+        free(found);
+    }
+    printf("Hough Transform completed.\n");
+    writeVoteTotalsAsImage(totals, height, width, maxVotes, debugFilename);
+
+    int dynamicThreshold=(int)(maxVotes* THRESHOLD_SCALE);
+    printf("Max Votes: %d, Dynamic Threshold: %d\n", maxVotes, dynamicThreshold);
+
+    Circle *circles;
+    *count=selectCircles(candidates, candidateCount, dynamicThreshold, selection.topK, &circles);
+    printf("Circles found: %d\n", *count);
+
+    freeHoughSpace(window);
+    free(totals);
+    free(candidates);
+    return circles;
+}
+
+//funct to draw the circles into the edge image and mark their centers in the maxima image
+void markCircles(const Circle *circles, int count, CircleOffsets offsets, Image edgeImage, Image houghMaxima) {
+    for(int k=0; k<count; k++) {
+        markDetectedCircles(edgeImage, offsets, circles[k].y, circles[k].x, circles[k].radius);
+        houghMaxima.map[circles[k].y][circles[k].x].i = 255; //mark maxima
+    }
+}
+
+//funct to write a circle list - as binary if the filename ends in .bin (the number of circles followed by
+//y, x, radius and votes of each as 32-bit integers in native byte order), else as CSV with a header line
+void writeCircles(const Circle *circles, int count, const char *filename) {
+    const char *dot=strrchr(filename, '.');
+    int binary=dot && strcmp(dot, ".bin")==0;
+    FILE *file=fopen(filename, binary ? "wb" : "w");
+    if(file==NULL) {
+        fprintf(stderr, "Can't write circle list %s.\n", filename);
+        exit(1);
+    }
+
+    if(binary) {
+        fwrite(&count, sizeof(int), 1, file);
+        for(int k=0; k<count; k++) {
+            int record[4]={circles[k].y, circles[k].x, circles[k].radius, circles[k].votes};
+            fwrite(record, sizeof(int), 4, file);
         }
+    } else {
+        fprintf(file, "y,x,radius,votes\n");
+        for(int k=0; k<count; k++)
+            fprintf(file, "%d,%d,%d,%d\n", circles[k].y, circles[k].x, circles[k].radius, circles[k].votes);
     }
+    fclose(file);
 }
 
 //funct to mark detected circles in the edge image
-void markDetectedCircles(Image img, int yCenter, int xCenter, int radius) {
-    for(int theta=0; theta<360; theta+=THETA_STEP) {
-        int x=xCenter+(int)(radius*cos(theta*M_PI/ 180.0));
-        int y=yCenter+(int)(radius *sin(theta*M_PI/180.0));
+void markDetectedCircles(Image img, CircleOffsets offsets, int yCenter, int xCenter, int radius) {
+    int first=offsets.first[radius-offsets.minRadius], last=offsets.first[radius-offsets.minRadius+1];
+    for(int o=first; o<last; o++) {
+        int x=xCenter+offsets.dx[o];
+        int y=yCenter+offsets.dy[o];
         if(x>=0 && x<img.width && y>= 0 && y < img.height) {
             img.map[y][x].i=255;  //mark circle edge
         }
@@ -147,6 +688,54 @@ int main(int argc, char *argv[]) {
     char *inputEdgeFile=argv[1];
     char *outputEdgeFile=argv[2];
     char *outputHoughFile=argv[3];
+    VotingMode mode=EXHAUSTIVE;
+    char *sourceFile=NULL; //image the edge map was detected on - for the gradients in directed mode
+    int spread=0;
+    int threads=0; //0 - one per processor
+    CircleSelection selection={NEIGHBORHOOD, NEIGHBORHOOD, 0};
+    char *circleFile=NULL;
+    int band=0; //radii voted for at a time, 0 - all
+
+    for(int a=4; a<argc; a++) {
+        if(strcmp(argv[a], "-mode")==0 && a+1<argc) {
+            int m=EXHAUSTIVE;
+            a++;
+            while(m<=DIRECTED && strcmp(argv[a], votingModeNames[m])!=0)
+                m++;
+            if(m>DIRECTED) {
+                fprintf(stderr, "Unknown voting mode %s, use exhaustive|directed.\n", argv[a]);
+                return 1;
+            }
+            mode=(VotingMode)m;
+        } else if(strcmp(argv[a], "-source")==0 && a+1<argc)
+            sourceFile=argv[++a];
+        else if(strcmp(argv[a], "-spread")==0 && a+1<argc)
+            spread=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-threads")==0 && a+1<argc)
+            threads=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-neighborhood")==0 && a+2<argc) {
+            selection.neighborhood=atoi(argv[++a]);
+            selection.radiusNeighborhood=atoi(argv[++a]);
+        } else if(strcmp(argv[a], "-top")==0 && a+1<argc)
+            selection.topK=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-circles")==0 && a+1<argc)
+            circleFile=argv[++a];
+        else if(strcmp(argv[a], "-band")==0 && a+1<argc)
+            band=atoi(argv[++a]);
+    }
+    if(mode==DIRECTED && sourceFile==NULL) {
+        fprintf(stderr, "Directed voting needs the source image of the edge map, given with -source.\n");
+        return 1;
+    }
+    if(spread<0 || spread>MAX_SPREAD) {
+        fprintf(stderr, "The spread must be between 0 and %d degrees.\n", MAX_SPREAD);
+        return 1;
+    }
+    if(band<0) {
+        fprintf(stderr, "The band must be a positive number of radii.\n");
+        return 1;
+    }
+
     Image edgeImage = readImage(inputEdgeFile);
 
     Image outputEdges = createImage(edgeImage.height, edgeImage.width);
@@ -167,20 +756,50 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    HoughSpace hough = createHoughSpace(edgeImage.height, edgeImage.width, MAX_RADIUS);
+    CircleOffsets offsets=createCircleOffsets(MIN_RADIUS, MAX_RADIUS);
+
+    HoughVoter voter;
+    if(mode==DIRECTED) {
+        //only the intensity plane of the source is needed
+        PlanarImage source=readPlanarImage(sourceFile, 0);
+        if(source.height!=edgeImage.height || source.width!=edgeImage.width) {
+            fprintf(stderr, "The source image must have the size of the edge map.\n");
+            return 1;
+        }
+        ChannelView intensity=planeView(source, source.i);
+        voter=createHoughVoter(edgeImage, mode, offsets, &intensity, spread);
+        deletePlanarImage(source);
+    } else
+        voter=createHoughVoter(edgeImage, mode, offsets, NULL, spread);
 
-    houghTransformCircles(edgeImage, &hough);
-    writeHoughSpaceAsImage(hough, "hough_space_debug.pgm");
-    findHoughMaxima(hough, outputEdges, houghMaxima);
+    int count;
+    Circle *circles;
+    if(band>0 && band<MAX_RADIUS-MIN_RADIUS) {
+        circles=findHoughMaximaBanded(voter, edgeImage.height, edgeImage.width, MIN_RADIUS, MAX_RADIUS, band,
+                                      selection, "hough_space_debug.pgm", &count, threads);
+    } else {
+        HoughSpace hough = createHoughSpace(edgeImage.height, edgeImage.width, MIN_RADIUS, MAX_RADIUS);
+        printf("Performing Hough Transform...\n");
+        houghTransformCircles(voter, &hough, threads);
+        printf("Hough Transform completed.\n");
+        writeHoughSpaceAsImage(hough, "hough_space_debug.pgm", threads);
+        circles=findHoughMaxima(hough, selection, &count, threads);
+        freeHoughSpace(hough);
+    }
+    markCircles(circles, count, offsets, outputEdges, houghMaxima);
+    if(circleFile)
+        writeCircles(circles, count, circleFile);
 
     writeImage(outputEdges, outputEdgeFile);
     writeImage(houghMaxima, outputHoughFile);
 
     //clean up
-    freeHoughSpace(hough);
+    freeHoughVoter(voter);
+    freeCircleOffsets(offsets);
     deleteImage(edgeImage);
     deleteImage(outputEdges);
     deleteImage(houghMaxima);
+    free(circles);
 
     printf("Hough transformation completed. Results saved to %s and %s\n", outputEdgeFile, outputHoughFile);
     return 0;
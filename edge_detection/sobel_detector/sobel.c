@@ -1,7 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
-#include <float.h>
+#include <limits.h>
 #include "netpbm.h"
 
 //funct for convolution
@@ -28,64 +29,207 @@ Matrix convolve(Matrix m1, Matrix m2) {
     return res;
 }
 
-//funct for sobel edge detection
-Image sobel(Image img) {
+//funct to load one source row into the rolling window of the fused sobel kernel
+//diff gets the horizontal difference [-1 0 1] and smooth the horizontal sum [1 2 1], both 0 in the border columns
+static inline void sobelLoadRow(const unsigned char *src, int step, int width, short *diff, short *smooth) {
+    diff[0]=smooth[0]=0;
+    diff[width-1]=smooth[width-1]=0;
+    for(int j=1; j<width-1; j++) {
+        diff[j]=src[(j+1)*step]-src[(j-1)*step];
+        smooth[j]=src[(j-1)*step]+2*src[j*step]+src[(j+1)*step];
+    }
+}
+
+//funct for the fused sobel kernel on rows first..first+count-1 of an intensity channel
+//each source row is read once into a rolling window of 3 rows of horizontal differences and sums,
+//from which gx=diff[y-1]+2*diff[y]+diff[y+1] and gy=smooth[y+1]-smooth[y-1] follow as 16-bit values
+//writes the squared gradient magnitudes of row y to out+(y-first)*width and lowers/raises *minval and *maxval
+//border pixels get 0 like in convolve
+void sobelRows(ChannelView img, int first, int count, int *out, int *minval, int *maxval) {
+    int width=img.width;
+    short *window=(short *)alignedMalloc(sizeof(short)*6*width);
+    short *diff[3], *smooth[3];
+    int lo=*minval, hi=*maxval;
+
+    for(int r=0; r<3; r++) {
+        diff[r]=window+2*r*width;
+        smooth[r]=window+(2*r+1)*width;
+    }
+
+    int next=MAX(first-1, 0); //next source row to load into the window
+    for(int y=first; y<first+count; y++) {
+        int *dst=out+(size_t)(y-first)*width;
+        if(y<1 || y>=img.height-1 || width<3) {
+            memset(dst, 0, sizeof(int)*width);
+            lo=MIN(lo, 0);
+            hi=MAX(hi, 0);
+            continue;
+        }
+        for(; next<=y+1; next++) {
+            if(img.step==1) //unit stride lets the compiler vectorize the common case
+                sobelLoadRow(img.data+img.stride*next, 1, width, diff[next%3], smooth[next%3]);
+            else
+                sobelLoadRow(img.data+img.stride*next, img.step, width, diff[next%3], smooth[next%3]);
+        }
+
+        const short *d0=diff[(y-1)%3], *d1=diff[y%3], *d2=diff[(y+1)%3];
+        const short *s0=smooth[(y-1)%3], *s2=smooth[(y+1)%3];
+        for(int j=0; j<width; j++) {
+            int gx=d0[j]+2*d1[j]+d2[j];
+            int gy=s2[j]-s0[j];
+            int m=gx*gx+gy*gy;
+            dst[j]=m;
+            lo=MIN(lo, m);
+            hi=MAX(hi, m);
+        }
+    }
+
+    *minval=lo;
+    *maxval=hi;
+    alignedFree(window);
+}
+
+//funct to scale count rows of squared gradient magnitudes to 0-255 as matrix2Image does
+//minval and maxval are the squared magnitude range of the whole frame
+static void scaleMagnitudes(const int *mag2, int count, int width, int minval, int maxval, Image res) {
+    double lo=sqrt((double)minval), hi=sqrt((double)maxval);
+    if(hi-lo<1e-10)
+        hi+=1.0;
+
+    for(int i=0; i<count; i++) {
+        const int *src=mag2+(size_t)i*width;
+        for(int j=0; j<width; j++) {
+            int value=(int)(255.0*((sqrt((double)src[j])-lo)/(hi-lo)) + 0.5);
+            res.map[i][j].r=res.map[i][j].g=res.map[i][j].b=res.map[i][j].i=MIN(MAX(value, 0), 255);
+        }
+    }
+}
+
+//funct for sobel edge detection on an intensity channel
+//one fused sweep gives all squared magnitudes and their range, a second one scales them to 0-255
+Image sobel(ChannelView img) {
+    int *mag2=(int *)alignedMalloc(sizeof(int)*img.height*img.width);
+    int minval=INT_MAX, maxval=INT_MIN;
+
+    sobelRows(img, 0, img.height, mag2, &minval, &maxval);
+
+    Image res=createImage(img.height, img.width);
+    scaleMagnitudes(mag2, img.height, img.width, minval, maxval, res);
+
+    alignedFree(mag2);
+    return res;
+}
+
+//funct to check that the fused kernel matches convolve on doubles bit for bit
+//returns the number of entries whose squared gradient magnitude differs
+int checkFusedGradients(ChannelView img) {
     double sobelx[3][3]={{-1,0,1}, {-2,0,2}, {-1,0,1}}; //for horizontal detection
     double sobely[3][3]={{-1,-2,-1}, {0,0,0}, {1,2,1}}; //for vertical detection
     
     Matrix sobelX=createMatrixFromArray(&sobelx[0][0], 3, 3);
     Matrix sobelY=createMatrixFromArray(&sobely[0][0], 3, 3);
     
-    Matrix img_matrix=image2Matrix(img); //convert image to a matrix of intensity values
-    Matrix resx=convolve(img_matrix, sobelX); //calculate horizontal gradients
-    Matrix resy=convolve(img_matrix, sobelY); //calculate vertical gradients
-    
-    Matrix sobelres=createMatrix(img.height, img.width);
-    
-    //to track max and min values in result
-    double maxval=-DBL_MAX;
-    double minval=DBL_MAX;
+    Matrix img_matrix=channel2Matrix(img); //convert channel to a matrix of intensity values
+    Matrix resx=convolve(img_matrix, sobelX);
+    Matrix resy=convolve(img_matrix, sobelY);
+
+    int *mag2=(int *)alignedMalloc(sizeof(int)*img.height*img.width);
+    int minval=INT_MAX, maxval=INT_MIN;
+    sobelRows(img, 0, img.height, mag2, &minval, &maxval);
     
+    int differences=0;
     for(int i=0; i<img.height; i++) {
         for(int j=0; j<img.width; j++) {
-            sobelres.map[i][j]=sqrt(pow(resx.map[i][j], 2) + pow(resy.map[i][j], 2));
-            if(sobelres.map[i][j]>maxval) 
-                maxval = sobelres.map[i][j];
-            if(sobelres.map[i][j]<minval) 
-                minval = sobelres.map[i][j];
+            double x=resx.map[i][j], y=resy.map[i][j];
+            if(x*x + y*y != mag2[(size_t)i*img.width+j])
+                differences++;
         }
     }
     
-    //scale to 0-255
-    Image res=matrix2Image(sobelres, 1, 1.0);
-    
     deleteMatrix(sobelX);
     deleteMatrix(sobelY);
     deleteMatrix(img_matrix);
     deleteMatrix(resx);
     deleteMatrix(resy);
-    deleteMatrix(sobelres);
+    alignedFree(mag2);
     
-    return res;
+    return differences;
+}
+
+//funct for sobel edge detection band by band, so only bandRows rows plus halo are in memory
+//the output is scaled by the range of the whole frame, so the bands are processed twice:
+//first to find the range and then to write the scaled values
+void sobelStreaming(char *inputFilename, char *sobelFilename, int bandRows) {
+    int minval=INT_MAX, maxval=INT_MIN;
+
+    //pass 1: range of squared gradient magnitudes
+    ImageReader reader=openImageReader(inputFilename, bandRows, 1);
+    int *mag2=(int *)alignedMalloc(sizeof(int)*bandRows*reader.width);
+    while(readBand(&reader)>0)
+        sobelRows(intensityView(reader.band), reader.first-reader.top, reader.count, mag2, &minval, &maxval);
+    closeImageReader(reader);
+
+    //pass 2: scale to 0-255 and append to the output file
+    reader=openImageReader(inputFilename, bandRows, 1);
+    ImageWriter writer=openImageWriter(sobelFilename, reader.height, reader.width);
+    Image res=createImage(bandRows, reader.width);
+    while(readBand(&reader)>0) {
+        int lo=minval, hi=maxval; //the band's own range is not needed here
+        sobelRows(intensityView(reader.band), reader.first-reader.top, reader.count, mag2, &lo, &hi);
+        scaleMagnitudes(mag2, reader.count, reader.width, minval, maxval, res);
+        writeRows(&writer, res, 0, reader.count);
+    }
+
+    closeImageReader(reader);
+    closeImageWriter(writer);
+    alignedFree(mag2);
+    deleteImage(res);
 }
 
 //edge detection function as per question
-void edgeDetection(char *inputFilename, char *sobelFilename) {
-    Image img=readImage(inputFilename);
+void edgeDetection(char *inputFilename, char *sobelFilename, int check) {
+    //only the intensity plane is loaded - 8-bit grayscale files are used straight from the file mapping
+    PlanarImage img=readPlanarImage(inputFilename, 0);
+    ChannelView src=planeView(img, img.i);
+
+    if(check) {
+        int differences=checkFusedGradients(src);
+        printf("Fused gradients: %d entries differ from the double convolution\n", differences);
+    }
     
     //call sobel
-    Image sobel_img=sobel(img);
+    Image sobel_img=sobel(src);
     writeImage(sobel_img, sobelFilename);
     
     //clean up
-    deleteImage(img);
+    deletePlanarImage(img);
     deleteImage(sobel_img);
 }
 
-int main() {
+int main(int argc, char **argv) {
     char *inputFile = "/Users/sumukharadhya/Downloads/CV/TermProject/edge_detection/sobel_detector/inputs/6.ppm";
     char *sobelFile = "/Users/sumukharadhya/Downloads/CV/TermProject/edge_detection/sobel_detector/outputs/color/6_op.ppm";
 
-    edgeDetection(inputFile, sobelFile);
+    int bandRows=0; //0 - process the whole frame at once
+    int check=0;
+
+    //paths given on the command line override the defaults
+    if(argc>2) {
+        inputFile=argv[1];
+        sobelFile=argv[2];
+    }
+    for(int a=3; a<argc; a++) {
+        if(strcmp(argv[a], "-band")==0 && a+1<argc)
+            bandRows=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-check")==0)
+            check=1;
+    }
+
+    if(bandRows>0) {
+        sobelStreaming(inputFile, sobelFile, bandRows);
+        return 0;
+    }
+
+    edgeDetection(inputFile, sobelFile, check);
     return 0;
 }
\ No newline at end of file
@@ -1,73 +1,438 @@
 #include "netpbm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-#define KERNEL_SIZE 5
-#define SIGMA 1.0
+#define SIGMA 1.0 //default, can be changed with -sigma
 
-//func to generate a Gaussian kernel
-void generateGaussianKernel(double kernel[KERNEL_SIZE][KERNEL_SIZE], double sigma) {
-    int halfSize=KERNEL_SIZE/2;
-    double sum=0.0;
+#define BOX_PASSES 3 //number of extended box filters in box mode
+#define BOX_SCALE 1048576.0f //box mode: the running sums count in steps of 1/BOX_SCALE, so they are exact
 
-    for(int i=0; i<KERNEL_SIZE; i++) {
-        for(int j=0; j<KERNEL_SIZE; j++) {
-            int x=i-halfSize;
-            int y=j-halfSize;
-            kernel[i][j]=exp(-(x*x+y*y)/(2*sigma*sigma))/(2*M_PI*sigma*sigma);
-            sum+=kernel[i][j];
+//ways to compute the filter - the exact kernel costs O(sigma) per pixel, the other two O(1)
+typedef enum {EXACT, RECURSIVE, BOX} GaussianMode;
+const char *modeNames[]={"exact", "recursive", "box"};
+
+//Gaussian kernel - separable, so one 1D filter is applied horizontally and then vertically
+typedef struct {
+    GaussianMode mode;
+    int radius;     //rows of context needed on each side of a band
+    float *weights; //exact: 2*radius+1 taps, normalized to sum 1
+    double b[4];    //recursive: Young - van Vliet coefficients b0..b3
+    int boxRadius;  //box: radius of each extended box, whose end taps have weight alpha
+    double alpha;
+} GaussianKernel;
+
+//funct to generate a Gaussian kernel, radius of 3*sigma covers all but 0.3% of the weight
+GaussianKernel generateGaussianKernel(double sigma, GaussianMode mode) {
+    GaussianKernel kernel={0};
+    kernel.mode=mode;
+    kernel.radius=(int)ceil(3.0*sigma);
+    if(kernel.radius<1)
+        kernel.radius=1;
+
+    if(mode==RECURSIVE) {
+        //Young & van Vliet, "Recursive implementation of the Gaussian filter", 1995
+        double q=sigma>=2.5? 0.98711*sigma-0.96330 : 3.97156-4.14554*sqrt(1.0-0.26891*sigma);
+        kernel.b[0]=1.57825+2.44413*q+1.4281*q*q+0.422205*q*q*q;
+        kernel.b[1]=2.44413*q+2.85619*q*q+1.26661*q*q*q;
+        kernel.b[2]=-(1.4281*q*q+1.26661*q*q*q);
+        kernel.b[3]=0.422205*q*q*q;
+        //the response never ends, so the context is twice as wide as for the exact kernel
+        kernel.radius=(int)ceil(6.0*sigma);
+    } else if(mode==BOX) {
+        //Gwosdek et al., "Theoretical foundations of Gaussian convolution by extended box filtering", 2011
+        //each pass contributes sigma^2/BOX_PASSES to the variance
+        double var=sigma*sigma/BOX_PASSES;
+        int l=(int)floor(0.5*sqrt(12.0*var+1.0)-0.5);
+        kernel.boxRadius=l;
+        kernel.alpha=(2*l+1)*(var-l*(l+1)/3.0)/(2.0*((l+1)*(l+1)-var));
+        kernel.radius=BOX_PASSES*(l+1); //support of all passes together
+    } else {
+        kernel.weights=(float*)malloc((2*kernel.radius+1)*sizeof(float));
+
+        double sum=0.0;
+        for(int i=-kernel.radius; i<=kernel.radius; i++)
+            sum+=exp(-(i*i)/(2*sigma*sigma));
+
+        //normalize kernel
+        for(int i=-kernel.radius; i<=kernel.radius; i++)
+            kernel.weights[i+kernel.radius]=(float)(exp(-(i*i)/(2*sigma*sigma))/sum);
+    }
+    return kernel;
+}
+
+void deleteGaussianKernel(GaussianKernel kernel) {
+    free(kernel.weights);
+}
+
+//funct for one tap loop of the separable filter: dst[x] = sum of weights[t]*rows[t][x]
+//the horizontal pass passes shifted pointers into one padded row, the vertical pass one pointer per row
+static void weightedSum(float *dst, const float **rows, const float *weights, int taps, int n) {
+    int x=0;
+#if defined(__AVX2__)
+    for(; x+8<=n; x+=8) {
+        __m256 acc=_mm256_setzero_ps();
+        for(int t=0; t<taps; t++) {
+#if defined(__FMA__)
+            acc=_mm256_fmadd_ps(_mm256_set1_ps(weights[t]), _mm256_loadu_ps(rows[t]+x), acc);
+#else
+            acc=_mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(weights[t]), _mm256_loadu_ps(rows[t]+x)));
+#endif
+        }
+        _mm256_storeu_ps(dst+x, acc);
+    }
+#endif
+#if defined(__SSE2__)
+    for(; x+4<=n; x+=4) {
+        __m128 acc=_mm_setzero_ps();
+        for(int t=0; t<taps; t++)
+            acc=_mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(rows[t]+x)));
+        _mm_storeu_ps(dst+x, acc);
+    }
+#endif
+    for(; x<n; x++) {
+        float acc=0.0f;
+        for(int t=0; t<taps; t++)
+            acc+=weights[t]*rows[t][x];
+        dst[x]=acc;
+    }
+}
+
+//funct to apply the exact Gaussian kernel to rows first..first+count-1 of an intensity channel
+//output row y goes to out[y-first]; pixels beyond the border repeat the border pixel
+void exactGaussianRows(ChannelView img, GaussianKernel kernel, int first, int count, Pixel **out) {
+    int r=kernel.radius;
+    int taps=2*r+1;
+    int width=img.width;
+
+    //ring of horizontally filtered rows - source row y is kept in slot y%taps
+    float *ring=(float*)malloc((size_t)taps*width*sizeof(float));
+    float *padded=(float*)malloc((width+2*r)*sizeof(float));
+    float *sum=(float*)malloc(width*sizeof(float));
+    const float **rows=(const float**)malloc(taps*sizeof(float*));
+    int nextRow=MAX(0, first-r); //next source row to filter horizontally
+
+    for(int y=first; y<first+count; y++) {
+        //horizontal pass for the source rows that newly enter the window
+        for(; nextRow<=MIN(img.height-1, y+r); nextRow++) {
+            const unsigned char *src=img.data+nextRow*img.stride;
+            //border handling is done once per row here, so the inner loops need no checks
+            for(int x=0; x<r; x++) {
+                padded[x]=src[0];
+                padded[r+width+x]=src[(width-1)*img.step];
+            }
+            for(int x=0; x<width; x++)
+                padded[r+x]=src[x*img.step];
+            for(int t=0; t<taps; t++)
+                rows[t]=padded+t;
+            weightedSum(ring+(size_t)(nextRow%taps)*width, rows, kernel.weights, taps, width);
+        }
+
+        //vertical pass over the window, with rows beyond the border clamped
+        for(int t=0; t<taps; t++) {
+            int sy=MIN(MAX(y+t-r, 0), img.height-1);
+            rows[t]=ring+(size_t)(sy%taps)*width;
+        }
+        weightedSum(sum, rows, kernel.weights, taps, width);
+
+        Pixel *dst=out[y-first];
+        for(int x=0; x<width; x++) {
+            int value=(int)(sum[x]+0.5f);
+            dst[x].r=dst[x].g=dst[x].b=dst[x].i=MIN(MAX(value, 0), 255);
         }
     }
+    free(ring);
+    free(padded);
+    free(sum);
+    free(rows);
+}
 
-    //normalize kernel
-    for(int i=0; i<KERNEL_SIZE; i++) {
-        for(int j=0; j<KERNEL_SIZE; j++) {
-            kernel[i][j]/=sum;
+//funct to copy rows y0..y1-1 of an intensity channel into a float plane with pad extra pixels on each side
+//the extra pixels repeat the nearest border pixel, so the filters below need no border checks
+static float *loadPadded(ChannelView img, int y0, int y1, int pad) {
+    int width=img.width+2*pad, height=y1-y0+2*pad;
+    float *plane=(float*)malloc((size_t)width*height*sizeof(float));
+
+    for(int y=0; y<height; y++) {
+        const unsigned char *src=img.data+MIN(MAX(y0+y-pad, y0), y1-1)*img.stride;
+        float *dst=plane+(size_t)y*width;
+        for(int x=0; x<pad; x++) {
+            dst[x]=src[0];
+            dst[pad+img.width+x]=src[(img.width-1)*img.step];
         }
+        for(int x=0; x<img.width; x++)
+            dst[pad+x]=src[x*img.step];
     }
+    return plane;
 }
 
-//funct to apply Gaussian filter
-Image applyGaussianFilter(Image img, double kernel[KERNEL_SIZE][KERNEL_SIZE]) {
-    Image result=createImage(img.height, img.width);
-    int halfSize=KERNEL_SIZE/2;
+//funct for the recursive filter along each row of a plane, in place
+//causal pass followed by anti-causal pass, each starting in the steady state of its first value
+static void recursiveRows(float *plane, int width, int height, const float *c) {
+    for(int y=0; y<height; y++) {
+        float *v=plane+(size_t)y*width;
+        float w1, w2, w3, w;
+
+        w1=w2=w3=v[0];
+        for(int x=0; x<width; x++) {
+            w=c[0]*v[x]+c[1]*w1+c[2]*w2+c[3]*w3;
+            v[x]=w;
+            w3=w2; w2=w1; w1=w;
+        }
+        w1=w2=w3=v[width-1];
+        for(int x=width-1; x>=0; x--) {
+            w=c[0]*v[x]+c[1]*w1+c[2]*w2+c[3]*w3;
+            v[x]=w;
+            w3=w2; w2=w1; w1=w;
+        }
+    }
+}
+
+//funct for the recursive filter down the columns of a plane, in place
+//the recursion runs over whole rows, so the inner loops are over x and vectorize
+static void recursiveColumns(float *plane, int width, int height, const float *c) {
+    //the border rows are their own steady state, so they stay as they are
+    for(int y=1; y<height; y++) {
+        float *row=plane+(size_t)y*width;
+        const float *r1=plane+(size_t)MAX(y-1, 0)*width;
+        const float *r2=plane+(size_t)MAX(y-2, 0)*width;
+        const float *r3=plane+(size_t)MAX(y-3, 0)*width;
+        for(int x=0; x<width; x++)
+            row[x]=c[0]*row[x]+c[1]*r1[x]+c[2]*r2[x]+c[3]*r3[x];
+    }
+    for(int y=height-2; y>=0; y--) {
+        float *row=plane+(size_t)y*width;
+        const float *r1=plane+(size_t)MIN(y+1, height-1)*width;
+        const float *r2=plane+(size_t)MIN(y+2, height-1)*width;
+        const float *r3=plane+(size_t)MIN(y+3, height-1)*width;
+        for(int x=0; x<width; x++)
+            row[x]=c[0]*row[x]+c[1]*r1[x]+c[2]*r2[x]+c[3]*r3[x];
+    }
+}
+
+//funct for one extended box filter along each row of a plane, from src to dst
+//only columns lo..hi-1 are computed, whose boxes lie within the row, so there are no border checks;
+//a running sum makes the cost per pixel independent of the box size; it adds and removes whole
+//steps of 1/BOX_SCALE, so it has no rounding error and each box sum is the same wherever the sum started
+static void boxRows(const float *src, float *dst, int width, int height, int lo, int hi, int l, double alpha) {
+    double norm=1.0/(2*l+1+2*alpha);
+
+    for(int y=0; y<height; y++) {
+        const float *v=src+(size_t)y*width;
+        float *out=dst+(size_t)y*width;
+        long long sum=0;
+        for(int x=lo-l; x<=lo+l; x++)
+            sum+=(int)(v[x]*BOX_SCALE);
+        for(int x=lo; x<hi; x++) {
+            out[x]=(float)((sum*(1.0/BOX_SCALE)+alpha*(v[x-l-1]+v[x+l+1]))*norm);
+            sum+=(int)(v[x+l+1]*BOX_SCALE)-(int)(v[x-l]*BOX_SCALE);
+        }
+    }
+}
+
+//funct for one extended box filter down the columns of a plane, from src to dst, for rows lo..hi-1
+//the running sums of all columns are kept in one row, so the inner loops are over x and vectorize;
+//they are exact like those of boxRows, so a band's rows come out as in the full frame
+static void boxColumns(const float *src, float *dst, int width, int lo, int hi, int l, double alpha, long long *sum) {
+    double norm=1.0/(2*l+1+2*alpha);
+
+    for(int x=0; x<width; x++)
+        sum[x]=0;
+    for(int y=lo-l; y<=lo+l; y++) {
+        const float *r=src+(size_t)y*width;
+        for(int x=0; x<width; x++)
+            sum[x]+=(int)(r[x]*BOX_SCALE);
+    }
+    for(int y=lo; y<hi; y++) {
+        const float *above=src+(size_t)(y-l-1)*width, *below=src+(size_t)(y+l+1)*width;
+        const float *leaving=src+(size_t)(y-l)*width;
+        float *row=dst+(size_t)y*width;
+        for(int x=0; x<width; x++) {
+            row[x]=(float)((sum[x]*(1.0/BOX_SCALE)+alpha*(above[x]+below[x]))*norm);
+            sum[x]+=(int)(below[x]*BOX_SCALE)-(int)(leaving[x]*BOX_SCALE);
+        }
+    }
+}
 
-    for(int y=0; y<img.height; y++) {
+//funct to apply the recursive or box approximation to rows first..first+count-1 of an intensity channel
+//the rows within kernel.radius of the requested ones are filtered together with them, and the plane
+//is padded by kernel.radius repeated border pixels, which hides the approximations' own border effects
+void approxGaussianRows(ChannelView img, GaussianKernel kernel, int first, int count, Pixel **out) {
+    int pad=kernel.radius;
+    int y0=MAX(0, first-pad);
+    int y1=MIN(img.height, first+count+pad);
+    int width=img.width+2*pad, height=y1-y0+2*pad;
+    float *plane=loadPadded(img, y0, y1, pad);
+    float *temp=(float*)malloc((size_t)width*height*sizeof(float));
+
+    if(kernel.mode==RECURSIVE) {
+        float c[4];
+        c[0]=(float)(1.0-(kernel.b[1]+kernel.b[2]+kernel.b[3])/kernel.b[0]);
+        for(int i=1; i<4; i++)
+            c[i]=(float)(kernel.b[i]/kernel.b[0]);
+        recursiveRows(plane, width, height, c);
+        recursiveColumns(plane, width, height, c);
+    } else {
+        //each pass shrinks the region where the result is valid by l+1 on each side,
+        //and the padding is BOX_PASSES*(l+1), so after the last pass exactly the image remains
+        int l=kernel.boxRadius;
+        long long *sum=(long long*)malloc(width*sizeof(long long));
+        float *swap;
+        for(int p=1; p<=BOX_PASSES; p++) {
+            boxRows(plane, temp, width, height, p*(l+1), width-p*(l+1), l, kernel.alpha);
+            swap=plane; plane=temp; temp=swap;
+        }
+        for(int p=1; p<=BOX_PASSES; p++) {
+            boxColumns(plane, temp, width, p*(l+1), height-p*(l+1), l, kernel.alpha, sum);
+            swap=plane; plane=temp; temp=swap;
+        }
+        free(sum);
+    }
+    free(temp);
+
+    for(int y=0; y<count; y++) {
+        const float *src=plane+(size_t)(first-y0+pad+y)*width+pad;
         for(int x=0; x<img.width; x++) {
-            double sum=0.0;
+            int value=(int)(src[x]+0.5f);
+            out[y][x].r=out[y][x].g=out[y][x].b=out[y][x].i=MIN(MAX(value, 0), 255);
+        }
+    }
+    free(plane);
+}
+
+//funct to apply Gaussian filter to rows first..first+count-1 of an intensity channel in the kernel's mode
+void gaussianRows(ChannelView img, GaussianKernel kernel, int first, int count, Pixel **out) {
+    if(kernel.mode==EXACT)
+        exactGaussianRows(img, kernel, first, count, out);
+    else
+        approxGaussianRows(img, kernel, first, count, out);
+}
+
+//funct to apply Gaussian filter to an intensity channel
+Image applyGaussianFilter(ChannelView img, GaussianKernel kernel) {
+    Image result=createImage(img.height, img.width);
+    gaussianRows(img, kernel, 0, img.height, result.map);
+    return result;
+}
+
+//funct to apply Gaussian filter to a file band by band, so only bandRows rows plus halo are in memory
+//exact and box modes give the same image as a full-frame run; in recursive mode a few pixels differ by one level
+void applyGaussianFilterStreaming(char *inputFilename, char *outputFilename, GaussianKernel kernel, int bandRows) {
+    ImageReader reader=openImageReader(inputFilename, bandRows, kernel.radius);
+    ImageWriter writer=openImageWriter(outputFilename, reader.height, reader.width);
+    Image result=createImage(bandRows, reader.width);
+
+    //the halo rows cover the kernel, so filtering the band gives the same result as the full frame;
+    //the recursive filter has infinite support and its float state depends on where it starts,
+    //so its output can't match exactly, but a halo of 6*sigma keeps the differences rare
+    while(readBand(&reader)>0) {
+        gaussianRows(intensityView(reader.band), kernel, reader.first-reader.top, reader.count, result.map);
+        writeRows(&writer, result, 0, reader.count);
+    }
+
+    closeImageReader(reader);
+    closeImageWriter(writer);
+    deleteImage(result);
+}
 
-            for(int ky=-halfSize; ky<=halfSize; ky++) {
-                for(int kx=-halfSize; kx<=halfSize; kx++) {
-                    int ny=y+ky;
-                    int nx=x+kx;
+//funct to compare each mode against the exact kernel on one image and print time and error
+void accuracyReport(ChannelView img, double sigma) {
+    Image exact={0};
 
-                    if(ny>=0 && ny<img.height && nx>=0 && nx<img.width) {
-                        sum+=img.map[ny][nx].i*kernel[ky+halfSize][kx+halfSize];
-                    }
-                }
+    printf("sigma %.2f, %dx%d pixels\n", sigma, img.width, img.height);
+    printf("%-10s %10s %10s %10s %10s\n", "mode", "time (ms)", "max err", "mean err", "PSNR (dB)");
+    for(int mode=EXACT; mode<=BOX; mode++) {
+        GaussianKernel kernel=generateGaussianKernel(sigma, (GaussianMode)mode);
+        clock_t start=clock();
+        Image result=applyGaussianFilter(img, kernel);
+        double ms=1000.0*(clock()-start)/CLOCKS_PER_SEC;
+        deleteGaussianKernel(kernel);
+
+        if(mode==EXACT) {
+            exact=result;
+            printf("%-10s %10.1f %10s %10s %10s\n", modeNames[mode], ms, "-", "-", "-");
+            continue;
+        }
+        int maxErr=0;
+        double sumErr=0.0, sumSq=0.0;
+        for(int y=0; y<img.height; y++) {
+            for(int x=0; x<img.width; x++) {
+                int err=abs(result.map[y][x].i-exact.map[y][x].i);
+                maxErr=MAX(maxErr, err);
+                sumErr+=err;
+                sumSq+=err*err;
             }
-            result.map[y][x].r=result.map[y][x].g=result.map[y][x].b=result.map[y][x].i=(int)sum;
         }
+        double n=(double)img.width*img.height;
+        double psnr=sumSq>0.0? 10.0*log10(255.0*255.0/(sumSq/n)) : INFINITY;
+        printf("%-10s %10.1f %10d %10.3f %10.2f\n", modeNames[mode], ms, maxErr, sumErr/n, psnr);
+        deleteImage(result);
     }
-    return result;
+    deleteImage(exact);
 }
 
 int main(int argc, char **argv) {
     char *inputFilename=argv[1];
     char *outputFilename=argv[2];
-    Image img=readImage(inputFilename);
+    int bandRows=0; //0 - process the whole frame at once
+    double sigma=SIGMA;
+    GaussianMode mode=EXACT;
+    int report=0;
+
+    for(int a=3; a<argc; a++) {
+        if(strcmp(argv[a], "-band")==0 && a+1<argc)
+            bandRows=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-sigma")==0 && a+1<argc)
+            sigma=atof(argv[++a]);
+        else if(strcmp(argv[a], "-mode")==0 && a+1<argc) {
+            int m=EXACT;
+            a++;
+            while(m<=BOX && strcmp(argv[a], modeNames[m])!=0)
+                m++;
+            if(m>BOX) {
+                fprintf(stderr, "Unknown mode %s, use exact|recursive|box.\n", argv[a]);
+                return 1;
+            }
+            mode=(GaussianMode)m;
+        } else if(strcmp(argv[a], "-report")==0)
+            report=1;
+    }
+    if(sigma<=0.0 || (sigma<0.5 && (mode==RECURSIVE || report))) {
+        fprintf(stderr, "Sigma must be positive, and at least 0.5 for the recursive filter.\n");
+        return 1;
+    }
+
+    GaussianKernel kernel=generateGaussianKernel(sigma, mode);
+
+    if(bandRows>0) {
+        if(report)
+            fprintf(stderr, "The accuracy report needs the whole frame and is skipped with -band.\n");
+        applyGaussianFilterStreaming(inputFilename, outputFilename, kernel, bandRows);
+        deleteGaussianKernel(kernel);
+        printf("Gaussian filtering completed. Output saved as %s\n", outputFilename);
+        return 0;
+    }
+
+    //only the intensity plane is loaded - 8-bit grayscale files are used straight from the file mapping
+    PlanarImage img=readPlanarImage(inputFilename, 0);
+    ChannelView src=planeView(img, img.i);
 
-    double kernel[KERNEL_SIZE][KERNEL_SIZE];
-    generateGaussianKernel(kernel, SIGMA);
+    if(report)
+        accuracyReport(src, sigma);
 
-    Image filteredImg=applyGaussianFilter(img, kernel);
+    Image filteredImg=applyGaussianFilter(src, kernel);
 
     writeImage(filteredImg, outputFilename);
 
     //cleanup
-    deleteImage(img);
+    deletePlanarImage(img);
     deleteImage(filteredImg);
+    deleteGaussianKernel(kernel);
 
     printf("Gaussian filtering completed. Output saved as %s\n", outputFilename);
     return 0;
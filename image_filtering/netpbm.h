@@ -2,6 +2,9 @@
 // Functions for reading and writing binary PBM, PGM, and PPM image files.
 // V2.2 by Marc Pomplun on 10/19/2013
 
+#include <stddef.h>
+#include <stdio.h>
+
 #define SQR(x) ((x)*(x))
 #define PI 3.14159265358979323846
 #define MIN(X,Y) ((X)<(Y)?(X):(Y))
@@ -11,6 +14,10 @@
 #define NO_CHANGE -1
 #define INVERT    -2
 
+// Pixel buffers of images and matrices start at, and every row is padded to, a multiple
+// of this many bytes, so that rows can be handed directly to SIMD code.
+#define ALIGNMENT 64
+
 // For each pixel, we store the R, G, and B values scaled from 0 to 255
 // and the intensity (brightness), which is automatically set to the
 // average of R, G, and B when creating or reading a new image.
@@ -21,23 +28,131 @@ typedef struct
 
 // Notice that the pixel map uses "matrix notation," i.e., map[i][j] refers to
 // the pixel in row i and column j (counting rows and columns starts with 0).
+// All pixels live in one contiguous, aligned buffer (data) in which row i starts at
+// data + i*stride; map is a table of pointers to these rows, so map[i][j] and
+// data[i*stride + j] refer to the same pixel.
 typedef struct 
 {
 	int height, width;
 	Pixel **map;
+	Pixel *data;
+	int stride;
 } Image;
 
 // Matrices are like Images except that they hold one real number (double) as
-// each entry instead of r, g, b, and i values.
+// each entry instead of r, g, b, and i values. They use the same contiguous layout.
 typedef struct 
 {
 	int height, width;
 	double **map;
+	double *data;
+	int stride;
 } Matrix;
 
+// Matrices of 16-bit integers, with the same layout as Matrix, hold the results of the
+// integer convolution functions below. They take a quarter of the memory of a Matrix.
+typedef struct 
+{
+	int height, width;
+	short **map;
+	short *data;
+	int stride;
+} ShortMatrix;
+
+// The largest supported size of integer convolution kernels.
+#define MAX_KERNEL_SIZE 7
+
+// Integer convolution kernel of size x size weights (size is odd), stored row by row.
+// Convolution results are divided by 2^shift with rounding.
+typedef struct
+{
+	int size, shift;
+	short weights[MAX_KERNEL_SIZE*MAX_KERNEL_SIZE];
+} IntKernel;
+
+// A pool of worker threads that stay alive between parallel loops, so that code running several
+// loops in a row starts its threads only once. Its fields are private to netpbm.c.
+typedef struct ThreadPool ThreadPool;
+
 // The three supported file types using 1, 8, and 24 bits per pixel, respectively. 
 typedef enum format {PBM, PGM, PPM} Format;
 
+// An image file that is being read in bands of rows by readBand. The band image holds the
+// core rows first to first + count - 1, which are to be processed, together with up to
+// halo rows above and below them; band.map[0] is image row top.
+typedef struct
+{
+	FILE *f;
+	char *filename;
+	Format filetype;
+	int height, width, imax;
+	int bandRows, halo;
+	size_t rowsize;
+	unsigned char *raw;
+	Image band;
+	int top, first, count;
+} ImageReader;
+
+// An image file that is being written row by row by writeRows.
+typedef struct
+{
+	FILE *f;
+	char *filename;
+	Format filetype;
+	int height, width, rowsWritten, rawRows;
+	size_t rowsize;
+	unsigned char *raw;
+} ImageWriter;
+
+// A binary PGM or PPM file mapped into memory by mapImage. Its raster is used as it is
+// in the file: sample c (0 for gray or red, 1 for green, 2 for blue) of the pixel in row i
+// and column j is data[i*stride + j*channels + c], with values from 0 to imax.
+typedef struct
+{
+	int height, width, channels, imax;
+	size_t stride;
+	const unsigned char *data;
+	void *mapping;
+	size_t mappingSize;
+} MappedImage;
+
+// Images can also be stored in planar form, with each channel in a plane of its own,
+// so that code working on the intensity alone touches a quarter of the memory and SIMD
+// code can process runs of neighboring values of one channel. Value (i, j) of a plane is
+// plane[i*stride + j]. Planes created by createPlanarImage start at ALIGNMENT-byte
+// boundaries and their rows are padded to a multiple of ALIGNMENT bytes. Intensity-only
+// images have r, g, and b set to NULL. The buffer and mapped fields hold the memory owned
+// by the image. If readOnly is nonzero, the planes are a read-only file mapping and must
+// not be written.
+typedef struct
+{
+	int height, width;
+	ptrdiff_t stride;
+	unsigned char *r, *g, *b, *i;
+	void *buffer;
+	MappedImage mapped;
+	int readOnly;
+} PlanarImage;
+
+// A read-only view of one 8-bit channel of an image or mapped file, so that filters
+// can run on either without converting: the value in row i and column j is
+// data[i*stride + j*step]. Views don't own memory and need not be deleted.
+typedef struct
+{
+	int height, width;
+	const unsigned char *data;
+	ptrdiff_t stride;
+	int step;
+} ChannelView;
+
+// Allocate a block of heap memory whose address is a multiple of ALIGNMENT.
+// The program exits with an error message if the memory cannot be allocated.
+// Such blocks must be freed using alignedFree rather than free.
+void *alignedMalloc(size_t size);
+
+// Free a block of heap memory allocated with alignedMalloc.
+void alignedFree(void *ptr);
+
 // Create a new image of the given size and fill it with white pixels.
 // When you don't need the image anymore, don't forget to free its memory using deleteImage.
 Image createImage(int height, int width);
@@ -67,6 +182,78 @@ Image readImage(char *filename);
 // (i) information is used, and for PPM files, only r, g, and b are relevant.
 void writeImage(Image img, char *filename);
 
+// Open an image file for reading it in bands of bandRows rows, each of which comes with
+// up to halo additional rows above and below it for neighborhood operations.
+// Only one band is held in memory at a time. Call readBand to get the bands one by one,
+// and close the reader using closeImageReader when you don't need it anymore.
+ImageReader openImageReader(char *filename, int bandRows, int halo);
+
+// Advance an image reader to the next band and return its number of core rows, or 0 if
+// the whole image has been read. Afterwards, reader->band holds image rows reader->top to
+// reader->top + reader->band.height - 1, and the core rows to be processed are rows
+// reader->first to reader->first + reader->count - 1.
+int readBand(ImageReader *reader);
+
+// Close an image reader and free its allocated memory on the heap.
+void closeImageReader(ImageReader reader);
+
+// Create an image file of the given size for writing it row by row. The file format is chosen
+// as in writeImage, and the header is written immediately. Append rows using writeRows, and
+// close the writer using closeImageWriter once all height rows have been written.
+ImageWriter openImageWriter(char *filename, int height, int width);
+
+// Append count rows, starting with row first of image img, to the file of an image writer.
+// The image must have the width that was given to openImageWriter.
+void writeRows(ImageWriter *writer, Image img, int first, int count);
+
+// Close an image writer and free its allocated memory on the heap.
+void closeImageWriter(ImageWriter writer);
+
+// Map a binary PGM or PPM file into memory without decoding or copying its raster.
+// If the file is a PBM file or its maximum value is not 255, its samples cannot be used
+// as they are, so nothing is mapped and data is NULL; use readImage for such files.
+// The raster is mapped read-only. When you don't need the mapping anymore, release it
+// using unmapImage.
+MappedImage mapImage(char *filename);
+
+// Release a file mapping created by mapImage.
+void unmapImage(MappedImage img);
+
+// Get a view of channel c (0 for gray or red, 1 for green, 2 for blue) of a mapped image.
+ChannelView mappedChannel(MappedImage img, int c);
+
+// Get a view of the intensity components of an image.
+ChannelView intensityView(Image img);
+
+// Create a new planar image of the given size and fill it with white pixels. If color == 0,
+// only the intensity plane is allocated and r, g, and b are NULL.
+// When you don't need the image anymore, don't forget to free its memory using deletePlanarImage.
+PlanarImage createPlanarImage(int height, int width, int color);
+
+// Delete a previously created or read planar image and free its memory.
+void deletePlanarImage(PlanarImage img);
+
+// Read an image from a file into planar form, with values from 0 to 255 like readImage.
+// If color == 0, only the intensity plane is filled in and r, g, and b are NULL.
+// If color == 0, an 8-bit PGM file read this way is not copied at all: its read-only file
+// mapping (see mapImage) becomes the intensity plane, so readOnly is set and this plane's
+// rows are not aligned in that case. Use image2Planar on a readImage result for planes that
+// can be written.
+PlanarImage readPlanarImage(char *filename, int color);
+
+// Convert an image into planar form. If color == 0, only the intensity plane is created.
+PlanarImage image2Planar(Image img, int color);
+
+// Convert a planar image into an image. For intensity-only planar images, the r, g, and b
+// components are set to the intensity.
+Image planar2Image(PlanarImage img);
+
+// Get a view of one plane (img.r, img.g, img.b, or img.i) of a planar image.
+ChannelView planeView(PlanarImage img, const unsigned char *plane);
+
+// Convert the values of a channel view into a matrix of identical size.
+Matrix channel2Matrix(ChannelView view);
+
 // Convert the intensity components of an image into a matrix of identical size.
 Matrix image2Matrix(Image img);
 
@@ -78,6 +265,63 @@ Matrix image2Matrix(Image img);
 // linear scaling.
 Image matrix2Image(Matrix mx, int scale, double gamma);
 
+// Create a new 16-bit integer matrix of the given size and fill it with zeroes.
+// When you don't need the matrix anymore, don't forget to free its memory using deleteShortMatrix.
+ShortMatrix createShortMatrix(int height, int width);
+
+// Delete a previously created 16-bit integer matrix and free its allocated memory on the heap.
+void deleteShortMatrix(ShortMatrix mx);
+
+// Create an integer convolution kernel of size x size weights, given row by row,
+// whose results are divided by 2^shift with rounding.
+IntKernel createIntKernel(const int *weights, int size, int shift);
+
+// The horizontal and vertical 3x3 Sobel kernels and the 3x3 binomial (Gaussian) kernel.
+// The binomial kernel sums to 16, so use shift 4 for a normalized result.
+// Convolution with these kernels uses code specialized for their weights.
+IntKernel sobelXKernel(void);
+IntKernel sobelYKernel(void);
+IntKernel binomialKernel(int shift);
+
+// Convolve rows first to first + count - 1 of an 8-bit channel with an integer kernel, writing
+// row y of the result to out[y - first]. Like convolve in the edge detectors, this sets entries
+// for which the kernel does not fit into the channel to 0, and as long as the results fit into
+// 16 bits, they are identical to those of convolve on the corresponding double matrix.
+void convolveChannelRows(ChannelView view, IntKernel k, int first, int count, short **out);
+
+// Convolve an 8-bit channel with an integer kernel into a new 16-bit matrix of identical size.
+// Entries for which the kernel does not fit into the channel are set to 0.
+ShortMatrix convolveChannel(ChannelView view, IntKernel k);
+
+// Convolve a 16-bit matrix with an integer kernel into a new 16-bit matrix of identical size.
+// Entries for which the kernel does not fit into the matrix are set to 0.
+ShortMatrix convolveShort(ShortMatrix mx, IntKernel k);
+
+// Convert a 16-bit integer matrix into a double matrix of identical size.
+Matrix short2Matrix(ShortMatrix mx);
+
+// Get the number of processors available to run threads on (at least 1).
+int processorCount(void);
+
+// Call task(arg, k) for k = 0 to count - 1 on a pool of up to threads threads (0 for one per
+// processor) and return when all calls are done. Each thread takes the next index as soon as it
+// is free, so tasks of unequal cost balance out. Without thread support, the calls run in order.
+// The threads are started for this call only; use a ThreadPool to run several loops in a row.
+void parallelFor(int count, int threads, void (*task)(void *arg, int k), void *arg);
+
+// Create a pool of up to threads threads (0 for one per processor), counting the calling thread,
+// which takes part in every loop run on the pool. Without thread support, loops run in order.
+// When you don't need the pool anymore, don't forget to stop it using deleteThreadPool.
+ThreadPool *createThreadPool(int threads);
+
+// Call task(arg, k) for k = 0 to count - 1 on the threads of a pool and return when all calls
+// are done. Each thread takes the next index as soon as it is free, as in parallelFor.
+// Only one loop at a time may run on a pool.
+void runThreadPool(ThreadPool *pool, int count, void (*task)(void *arg, int k), void *arg);
+
+// Stop the threads of a pool and free its memory.
+void deleteThreadPool(ThreadPool *pool);
+
 // Set color for pixel (vPos, hPos) in image img.
 // If r, g, b, or i are set to NO_CHANGE, the corresponding color channels are left unchanged in img.
 // If they are set to INVERT, the corresponding channels are inverted, i.e., set to 255 minus their original value
@@ -2,6 +2,7 @@
 // Functions for reading and writing binary PBM, PGM, and PPM image files.
 // V2.2 by Marc Pomplun on 10/19/2013
 #define _CRT_SECURE_NO_WARNINGS
+#define _POSIX_C_SOURCE 200112L
 
 #include "netpbm.h"
 #include <stdio.h>
@@ -9,28 +10,63 @@
 #include <float.h>
 #include <string.h>
 #include <math.h>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 
 
+// Allocate a block of heap memory whose address is a multiple of ALIGNMENT.
+// The program exits with an error message if the memory cannot be allocated.
+// Such blocks must be freed using alignedFree rather than free.
+void *alignedMalloc(size_t size)
+{
+	void *ptr;
+
+#ifdef _WIN32
+	ptr = _aligned_malloc(size, ALIGNMENT);
+#else
+	if (posix_memalign(&ptr, ALIGNMENT, size) != 0)
+		ptr = NULL;
+#endif
+	if (ptr == NULL && size > 0)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+// Free a block of heap memory allocated with alignedMalloc.
+void alignedFree(void *ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
 // Create a new image of the given size and fill it with white pixels.
 // When you don't need the image anymore, don't forget to free its memory using deleteImage.
 Image createImage(int height, int width)
 {
-	int i, j;
+	int i;
 	Image img;
 
+	// Round each row up to a whole number of ALIGNMENT-byte blocks.
+	img.stride = (int) ((sizeof(Pixel)*width + ALIGNMENT - 1)/ALIGNMENT*ALIGNMENT/sizeof(Pixel));
+	img.data = (Pixel *) alignedMalloc(sizeof(Pixel)*img.stride*height);
 	img.map = (Pixel **) malloc(sizeof(Pixel *)*height);
 	for (i = 0; i < height; i++)
-	{
-		img.map[i] = (Pixel *) malloc(sizeof(Pixel)*width);
-		for (j = 0; j < width; j++)
-		{
-			img.map[i][j].r = 255;
-			img.map[i][j].g = 255;
-			img.map[i][j].b = 255;
-			img.map[i][j].i = 255;
-		}
-	}
+		img.map[i] = img.data + (size_t) img.stride*i;
+	// All four channels of a white pixel are 255, so the whole buffer can be set at once.
+	memset(img.data, 255, sizeof(Pixel)*img.stride*height);
 	img.height = height;
 	img.width = width;
 	return img;
@@ -39,10 +75,7 @@ Image createImage(int height, int width)
 // Delete a previously created image and free its allocated memory on the heap. 
 void deleteImage(Image img)
 {
-	int i;
-	
-	for (i = 0; i < img.height; i++)
-		free(img.map[i]);
+	alignedFree(img.data);
 	free(img.map);
 }
 
@@ -50,16 +83,16 @@ void deleteImage(Image img)
 // When you don't need the matrix anymore, don't forget to free its memory using deleteMatrix.
 Matrix createMatrix(int height, int width)
 {
-	int i, j;
+	int i;
 	Matrix mx;
 
+	mx.stride = (int) ((sizeof(double)*width + ALIGNMENT - 1)/ALIGNMENT*ALIGNMENT/sizeof(double));
+	mx.data = (double *) alignedMalloc(sizeof(double)*mx.stride*height);
 	mx.map = (double **) malloc(sizeof(double *)*height);
 	for (i = 0; i < height; i++)
-	{
-		mx.map[i] = (double *) malloc(sizeof(double)*width);
-		for (j = 0; j < width; j++)
-			mx.map[i][j] = 0.0;
-	}
+		mx.map[i] = mx.data + (size_t) mx.stride*i;
+	// An all-zero bit pattern is 0.0 in IEEE 754 arithmetic.
+	memset(mx.data, 0, sizeof(double)*mx.stride*height);
 	mx.height = height;
 	mx.width = width;
 	return mx;
@@ -70,42 +103,27 @@ Matrix createMatrix(int height, int width)
 // When you don't need the matrix anymore, don't forget to free its memory using deleteMatrix.
 Matrix createMatrixFromArray(double *entry, int height, int width)
 {
-	int i, j;
-	Matrix mx;
+	int i;
+	Matrix mx = createMatrix(height, width);
 
-	mx.map = (double **) malloc(sizeof(double *)*height);
 	for (i = 0; i < height; i++)
-	{
-		mx.map[i] = (double *) malloc(sizeof(double)*width);
-		for (j = 0; j < width; j++)
-			mx.map[i][j] = *(entry++);
-	}
-	mx.height = height;
-	mx.width = width;
+		memcpy(mx.map[i], entry + (size_t) width*i, sizeof(double)*width);
 	return mx;
 }
 
 // Delete a previously created matrix and free its allocated memory on the heap. 
 void deleteMatrix(Matrix mx)
 {
-	int m;
-	
-	for (m = 0; m < mx.height; m++)
-		free(mx.map[m]);
+	alignedFree(mx.data);
 	free(mx.map);
 }
 
-// Read an image from a file and allocate the required heap memory for it.
-// Notice that only binary Netpbm files are supported. Regardless of the
-// file type, all fields r, g, b, and i are filled in, with values from 0 to 255. 
-Image readImage(char *filename)
+// Open a binary Netpbm file and read its header, leaving the file positioned at the first
+// byte of the raster data. The maximum value imax is set to 1 for PBM files.
+static FILE *openImageFile(char *filename, Format *filetype, int *width, int *height, int *imax)
 {
 	FILE *f;
-	int i, j, width, height, imax=0, bitsPerPixel, filesize, mapsize, mempos;
 	char type[200], line[200];
-	unsigned char *temp, output;
-	Image img;
-	Format filetype;
 
 	f = fopen(filename, "rb");
 	if (!f)
@@ -123,176 +141,636 @@ Image readImage(char *filename)
 	switch (type[1])
 	{
 	case '4': 
-		filetype = PBM;
-		bitsPerPixel = 1;
+		*filetype = PBM;
 		break;
 	case '5': 
-		filetype = PGM;
-		bitsPerPixel = 8;
+		*filetype = PGM;
 		break;
 	default:  
-		filetype = PPM;
-		bitsPerPixel = 24;
+		*filetype = PPM;
 	}
 
 	line[0] = '#';
 	while (line[0] == '#' || line[0] == 10 || line[0] == 13)
 		fgets(line, 200, f); 
-	sscanf(line, "%d %d", &width, &height);
-	if (filetype != PBM)
+	sscanf(line, "%d %d", width, height);
+	*imax = 1;
+	if (*filetype != PBM)
 	{
 		fgets(line, 200, f); 
-		sscanf(line, "%d", &imax);
+		sscanf(line, "%d", imax);
 	}
-	if (width <= 0 || height <= 0)
+	if (*width <= 0 || *height <= 0 || *imax <= 0)
 	{
 		fprintf(stderr, "Invalid image size in input file %s.\n", filename);
 		exit(1);
 	}
+	return f;
+}
 
-	// Notice: In PBM files, every row starts with a new byte.
-	mapsize = (bitsPerPixel*width + 7)/8*height;
-	temp = (unsigned char *) malloc(mapsize);
-	// Using fread is much faster than reading byte-by-byte. 
-	filesize = (int) fread((void *) temp, 1,mapsize,  f);
-	fclose(f);
-	if (filesize != mapsize)
+// Get the number of bytes per row of raster data in a file. 
+// Notice: In PBM files, every row starts with a new byte.
+static size_t rasterRowSize(Format filetype, int width)
+{
+	int bitsPerPixel = (filetype == PBM)? 1 : (filetype == PGM)? 8 : 24;
+
+	return (bitsPerPixel*(size_t) width + 7)/8;
+}
+
+// Convert one row of raster data from a file into pixels with values from 0 to 255.
+static void decodeRow(const unsigned char *src, Pixel *dst, int width, Format filetype, int imax)
+{
+	int j;
+	unsigned char output;
+
+	switch (filetype)
 	{
-		fprintf(stderr, "Data missing in file %s.\n", filename);
-		exit(1);
+	case PBM: 
+		for (j = 0; j < width; j++)
+		{
+			output = 255*(((src[j/8] & (128 >> j%8)) == 0));
+			dst[j].r = dst[j].g = dst[j].b = dst[j].i = output;
+		}
+		break;
+	case PGM: 
+		for (j = 0; j < width; j++)
+		{
+			output = (unsigned char) ((int) src[j]*255/imax);
+			dst[j].r = dst[j].g = dst[j].b = dst[j].i = output;
+		}
+		break;
+	case PPM:
+		for (j = 0; j < width; j++, src += 3)
+		{
+			dst[j].r = (unsigned char) ((int) src[0]*255/imax);
+			dst[j].g = (unsigned char) ((int) src[1]*255/imax);
+			dst[j].b = (unsigned char) ((int) src[2]*255/imax);
+			dst[j].i = (unsigned char) (((int) src[0] + (int) src[1] + (int) src[2])*255/(3*imax));
+		}
 	}
+}
 
-	img = createImage(height, width);
-	for (i = 0; i < height; i++)
+// Convert one row of pixels into raster data for a file.
+static void encodeRow(const Pixel *src, unsigned char *dst, int width, Format filetype)
+{
+	int j;
+
+	switch (filetype)
+	{
+	case PBM: 
+		memset(dst, 0, rasterRowSize(PBM, width));
 		for (j = 0; j < width; j++)
+			if (src[j].i < 128)
+				dst[j/8] |= 128>>(j%8);
+		break;
+	case PGM: 
+		for (j = 0; j < width; j++)
+			dst[j] = src[j].i;
+		break;
+	case PPM: 
+		for (j = 0; j < width; j++, dst += 3)
 		{
-			mempos = (bitsPerPixel*width + 7)/8*i + (bitsPerPixel*j)/8;
-			switch (filetype)
-			{
-			case PBM: 
-				output = 255*(((temp[mempos] & (128 >> j%8)) == 0));
-				img.map[i][j].r = output;
-				img.map[i][j].g = output;
-				img.map[i][j].b = output;
-				img.map[i][j].i = output;
-				break;
-			case PGM: 
-				output = (unsigned char) ((int) temp[mempos]*255/imax);
-				img.map[i][j].r = output;
-				img.map[i][j].g = output;
-				img.map[i][j].b = output;
-				img.map[i][j].i = output;
-				break;
-			case PPM:
-				img.map[i][j].r = (unsigned char) ((int) temp[mempos]*255/imax);
-				img.map[i][j].g = (unsigned char) ((int) temp[mempos + 1]*255/imax);
-				img.map[i][j].b = (unsigned char) ((int) temp[mempos + 2]*255/imax);
-				img.map[i][j].i = (unsigned char) (((int) temp[mempos] + (int) temp[mempos + 1] + (int) temp[mempos + 2])*255/(3*imax));
-                     
-			}
+			dst[0] = src[j].r;
+			dst[1] = src[j].g;
+			dst[2] = src[j].b;
 		}
-	free(temp);
-	return img;
+	}
 }
 
-// Write an image to a file. The file format (binary PBM, PGM, or PPM) is automatically
-// chosen based on the given file name. For PBM and PGM files, only the intensity
-// (i) information is used, and for PPM files, only r, g, and b are relevant.
-void writeImage(Image img, char *filename)
+// Create an output file whose type is chosen based on the given file name and write its header.
+static FILE *createImageFile(char *filename, Format *filetype, int height, int width)
 {
-	Format filetype;
 	FILE *f;
-	int i, j, mapsize, bitsPerPixel, bitsum, mempos;
-	unsigned char *temp;
 
 	switch (filename[strlen(filename) - 2])
 	{
 	case 'b':
 	case 'B': 
-		filetype = PBM;
-		bitsPerPixel = 1;
+		*filetype = PBM;
 		break;
 	case 'g':
 	case 'G': 
-		filetype = PGM;
-		bitsPerPixel = 8;
+		*filetype = PGM;
 		break;
 	case 'p':
 	case 'P': 
-		filetype = PPM;
-		bitsPerPixel = 24;
+		*filetype = PPM;
 		break;
 	default:  
 		fprintf(stderr, "Invalid output file name: %s.\n", filename);
 		exit(1);
 	}
 
-	if (img.width <= 0 || img.height <= 0)
+	if (width <= 0 || height <= 0)
 	{
 		fprintf(stderr, "Invalid image size in output file %s.\n", filename);
 		exit(1);
 	}
 
-	// Notice: In PBM files, every row starts with a new byte.
-	mapsize = (bitsPerPixel*img.width + 7)/8*img.height;
-	// Creating linear file data in memory and then using fwrite is much faster than writing byte-by-byte. 
-	temp = (unsigned char *) malloc(mapsize);
-	mempos = 0;
-	bitsum = 0;
-	for (i = 0; i < img.height; i++)
-		for (j = 0; j < img.width; j++)
-			switch (filetype)
-			{
-			case PBM: 
-				if (img.map[i][j].i < 128)
-					bitsum += 128>>(j%8);
-				if (j%8 == 7 || j == img.width - 1)
-				{
-					temp[mempos++] = (unsigned char) bitsum;
-					bitsum = 0;
-				}
-				break;
-			case PGM: 
-				temp[mempos++] = img.map[i][j].i;
-				break;
-			case PPM: 
-				temp[mempos++] = img.map[i][j].r;
-				temp[mempos++] = img.map[i][j].g;
-				temp[mempos++] = img.map[i][j].b;
-		    }
-
 	f = fopen(filename, "wb");
 	if (!f)
 	{
 		fprintf(stderr, "Can't open output file %s.\n", filename);
 		exit(1);
 	}
-	switch (filetype)
+	switch (*filetype)
 	{
 	case PBM: 
-		fprintf(f, "P4\n# Created by netpbm.c\n%d %d\n", img.width, img.height);
+		fprintf(f, "P4\n# Created by netpbm.c\n%d %d\n", width, height);
 		break;
 	case PGM: 
-		fprintf(f, "P5\n# Created by netpbm.c\n%d %d\n255\n", img.width, img.height);
+		fprintf(f, "P5\n# Created by netpbm.c\n%d %d\n255\n", width, height);
 		break;
 	case PPM: 
-		fprintf(f, "P6\n# Created by netpbm.c\n%d %d\n255\n", img.width, img.height);
+		fprintf(f, "P6\n# Created by netpbm.c\n%d %d\n255\n", width, height);
 	}
+	return f;
+}
+
+// Read an image from a file and allocate the required heap memory for it.
+// Notice that only binary Netpbm files are supported. Regardless of the
+// file type, all fields r, g, b, and i are filled in, with values from 0 to 255. 
+Image readImage(char *filename)
+{
+	FILE *f;
+	int i, width, height, imax;
+	size_t rowsize, mapsize, filesize;
+	unsigned char *temp;
+	Image img;
+	Format filetype;
+
+	f = openImageFile(filename, &filetype, &width, &height, &imax);
+	rowsize = rasterRowSize(filetype, width);
+	mapsize = rowsize*height;
+	temp = (unsigned char *) malloc(mapsize);
+	// Using fread is much faster than reading byte-by-byte. 
+	filesize = fread((void *) temp, 1, mapsize, f);
+	fclose(f);
+	if (filesize != mapsize)
+	{
+		fprintf(stderr, "Data missing in file %s.\n", filename);
+		exit(1);
+	}
+
+	// Both the file data and the image are traversed row by row in memory order.
+	img = createImage(height, width);
+	for (i = 0; i < height; i++)
+		decodeRow(temp + rowsize*i, img.map[i], width, filetype, imax);
+	free(temp);
+	return img;
+}
+
+// Write an image to a file. The file format (binary PBM, PGM, or PPM) is automatically
+// chosen based on the given file name. For PBM and PGM files, only the intensity
+// (i) information is used, and for PPM files, only r, g, and b are relevant.
+void writeImage(Image img, char *filename)
+{
+	Format filetype;
+	FILE *f;
+	int i;
+	size_t rowsize, mapsize;
+	unsigned char *temp;
+
+	f = createImageFile(filename, &filetype, img.height, img.width);
+	rowsize = rasterRowSize(filetype, img.width);
+	mapsize = rowsize*img.height;
+	// Creating linear file data in memory and then using fwrite is much faster than writing byte-by-byte. 
+	temp = (unsigned char *) malloc(mapsize);
+	for (i = 0; i < img.height; i++)
+		encodeRow(img.map[i], temp + rowsize*i, img.width, filetype);
 	fwrite((void *) temp, 1, mapsize, f);
 	fclose(f);
 	free(temp);
 }
 
+// Open an image file for reading it in bands of bandRows rows, each of which comes with
+// up to halo additional rows above and below it for neighborhood operations.
+// Only one band is held in memory at a time. Call readBand to get the bands one by one,
+// and close the reader using closeImageReader when you don't need it anymore.
+ImageReader openImageReader(char *filename, int bandRows, int halo)
+{
+	ImageReader reader;
+
+	if (bandRows <= 0 || halo < 0)
+	{
+		fprintf(stderr, "Invalid band size for input file %s.\n", filename);
+		exit(1);
+	}
+	reader.f = openImageFile(filename, &reader.filetype, &reader.width, &reader.height, &reader.imax);
+	reader.filename = filename;
+	reader.bandRows = bandRows;
+	reader.halo = halo;
+	reader.rowsize = rasterRowSize(reader.filetype, reader.width);
+	reader.raw = (unsigned char *) malloc(reader.rowsize);
+	reader.band = createImage(bandRows + 2*halo, reader.width);
+	reader.band.height = 0;
+	reader.top = reader.first = reader.count = 0;
+	return reader;
+}
+
+// Advance an image reader to the next band and return its number of core rows, or 0 if
+// the whole image has been read. Afterwards, reader->band holds image rows reader->top to
+// reader->top + reader->band.height - 1, and the core rows to be processed are rows
+// reader->first to reader->first + reader->count - 1. Halo rows that were already part of
+// the previous band are moved rather than read again.
+int readBand(ImageReader *reader)
+{
+	int i, newTop, newEnd, loaded = reader->top + reader->band.height;
+
+	reader->first += reader->count;
+	reader->count = MIN(reader->bandRows, reader->height - reader->first);
+	if (reader->count <= 0)
+	{
+		reader->count = 0;
+		return 0;
+	}
+	newTop = MAX(0, reader->first - reader->halo);
+	newEnd = MIN(reader->height, reader->first + reader->count + reader->halo);
+
+	// Thanks to the contiguous storage, keeping the overlapping rows takes a single move.
+	if (loaded > newTop)
+		memmove(reader->band.data, reader->band.map[newTop - reader->top],
+			sizeof(Pixel)*reader->band.stride*(loaded - newTop));
+	else
+		loaded = newTop;
+	for (i = loaded; i < newEnd; i++)
+	{
+		if (fread((void *) reader->raw, 1, reader->rowsize, reader->f) != reader->rowsize)
+		{
+			fprintf(stderr, "Data missing in file %s.\n", reader->filename);
+			exit(1);
+		}
+		decodeRow(reader->raw, reader->band.map[i - newTop], reader->width, reader->filetype, reader->imax);
+	}
+	reader->top = newTop;
+	reader->band.height = newEnd - newTop;
+	return reader->count;
+}
+
+// Close an image reader and free its allocated memory on the heap.
+void closeImageReader(ImageReader reader)
+{
+	fclose(reader.f);
+	free(reader.raw);
+	deleteImage(reader.band);
+}
+
+// Create an image file of the given size for writing it row by row. The file format is chosen
+// as in writeImage, and the header is written immediately. Append rows using writeRows, and
+// close the writer using closeImageWriter once all height rows have been written.
+ImageWriter openImageWriter(char *filename, int height, int width)
+{
+	ImageWriter writer;
+
+	writer.f = createImageFile(filename, &writer.filetype, height, width);
+	writer.filename = filename;
+	writer.height = height;
+	writer.width = width;
+	writer.rowsWritten = 0;
+	writer.rowsize = rasterRowSize(writer.filetype, width);
+	writer.raw = NULL;
+	writer.rawRows = 0;
+	return writer;
+}
+
+// Append count rows, starting with row first of image img, to the file of an image writer.
+// The image must have the width that was given to openImageWriter.
+void writeRows(ImageWriter *writer, Image img, int first, int count)
+{
+	int i;
+
+	if (img.width != writer->width || writer->rowsWritten + count > writer->height)
+	{
+		fprintf(stderr, "Invalid image size in output file %s.\n", writer->filename);
+		exit(1);
+	}
+	if (count > writer->rawRows)
+	{
+		free(writer->raw);
+		writer->raw = (unsigned char *) malloc(writer->rowsize*count);
+		writer->rawRows = count;
+	}
+	for (i = 0; i < count; i++)
+		encodeRow(img.map[first + i], writer->raw + writer->rowsize*i, img.width, writer->filetype);
+	fwrite((void *) writer->raw, 1, writer->rowsize*count, writer->f);
+	writer->rowsWritten += count;
+}
+
+// Close an image writer and free its allocated memory on the heap.
+void closeImageWriter(ImageWriter writer)
+{
+	fclose(writer.f);
+	free(writer.raw);
+	if (writer.rowsWritten != writer.height)
+	{
+		fprintf(stderr, "Data missing in output file %s.\n", writer.filename);
+		exit(1);
+	}
+}
+
+// Map a binary PGM or PPM file into memory without decoding or copying its raster.
+// The samples are the raw file values from 0 to imax; sample c of the pixel in row i and
+// column j is data[i*stride + j*channels + c]. If the file is a PBM file or its maximum
+// value is not 255, its samples cannot be used as they are, so nothing is mapped and
+// data is NULL; use readImage for such files. Release the mapping using unmapImage.
+MappedImage mapImage(char *filename)
+{
+	FILE *f;
+	int width, height, imax;
+	long offset;
+	size_t filesize;
+	Format filetype;
+	MappedImage img;
+
+	memset(&img, 0, sizeof(img));
+	f = openImageFile(filename, &filetype, &width, &height, &imax);
+	img.height = height;
+	img.width = width;
+	img.imax = imax;
+	img.channels = (filetype == PPM)? 3 : 1;
+	img.stride = (size_t) width*img.channels;
+	if (filetype == PBM || imax != 255)
+	{
+		fclose(f);
+		return img;
+	}
+	offset = ftell(f);
+
+#ifdef _WIN32
+	// No mmap here, so fall back to one bulk read of the whole file.
+	fseek(f, 0, SEEK_END);
+	filesize = (size_t) ftell(f);
+	img.mappingSize = filesize;
+	img.mapping = malloc(filesize);
+	fseek(f, 0, SEEK_SET);
+	if (fread(img.mapping, 1, filesize, f) != filesize)
+		filesize = 0;
+#else
+	{
+		struct stat st;
+
+		if (fstat(fileno(f), &st) != 0)
+		{
+			fprintf(stderr, "Can't open input file %s.\n", filename);
+			exit(1);
+		}
+		filesize = (size_t) st.st_size;
+		img.mappingSize = filesize;
+		// The mapping is read-only, so nothing can write through it to the page cache.
+		img.mapping = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (img.mapping == MAP_FAILED)
+		{
+			fprintf(stderr, "Can't map input file %s.\n", filename);
+			exit(1);
+		}
+		// The tools sweep the raster from top to bottom, so let the kernel read ahead.
+		posix_madvise(img.mapping, filesize, POSIX_MADV_SEQUENTIAL);
+	}
+#endif
+	fclose(f);
+	if (filesize < (size_t) offset + img.stride*height)
+	{
+		fprintf(stderr, "Data missing in file %s.\n", filename);
+		exit(1);
+	}
+	img.data = (const unsigned char *) img.mapping + offset;
+	return img;
+}
+
+// Release a file mapping created by mapImage.
+void unmapImage(MappedImage img)
+{
+	if (img.mapping == NULL)
+		return;
+#ifdef _WIN32
+	free(img.mapping);
+#else
+	munmap(img.mapping, img.mappingSize);
+#endif
+}
+
+// Get a view of channel c (0 for gray or red, 1 for green, 2 for blue) of a mapped image.
+ChannelView mappedChannel(MappedImage img, int c)
+{
+	ChannelView view;
+
+	view.height = img.height;
+	view.width = img.width;
+	view.data = img.data + c;
+	view.stride = (ptrdiff_t) img.stride;
+	view.step = img.channels;
+	return view;
+}
+
+// Get a view of the intensity components of an image.
+ChannelView intensityView(Image img)
+{
+	ChannelView view;
+
+	view.height = img.height;
+	view.width = img.width;
+	view.data = &img.data[0].i;
+	view.stride = (ptrdiff_t) (sizeof(Pixel)*img.stride);
+	view.step = (int) sizeof(Pixel);
+	return view;
+}
+
+// Convert the values of a channel view into a matrix of identical size.
+Matrix channel2Matrix(ChannelView view)
+{
+	int m, n;
+	Matrix result = createMatrix(view.height, view.width);
+	const unsigned char *src;
+	double *dst;
+
+	for (m = 0; m < view.height; m++)
+	{
+		src = view.data + view.stride*m;
+		dst = result.map[m];
+		for (n = 0; n < view.width; n++)
+			dst[n] = (double) src[n*view.step];
+	}
+	return result;
+}
+
+// Create a new planar image of the given size and fill it with white pixels. If color == 0,
+// only the intensity plane is allocated and r, g, and b are NULL.
+// When you don't need the image anymore, don't forget to free its memory using deletePlanarImage.
+PlanarImage createPlanarImage(int height, int width, int color)
+{
+	PlanarImage img;
+	size_t planesize;
+
+	memset(&img, 0, sizeof(img));
+	img.height = height;
+	img.width = width;
+	img.stride = (width + ALIGNMENT - 1)/ALIGNMENT*ALIGNMENT;
+	planesize = (size_t) img.stride*height;
+	img.buffer = alignedMalloc(planesize*(color? 4 : 1));
+	memset(img.buffer, 255, planesize*(color? 4 : 1));
+	img.i = (unsigned char *) img.buffer;
+	if (color)
+	{
+		img.r = img.i + planesize;
+		img.g = img.r + planesize;
+		img.b = img.g + planesize;
+	}
+	return img;
+}
+
+// Delete a previously created or read planar image and free its memory.
+void deletePlanarImage(PlanarImage img)
+{
+	alignedFree(img.buffer);
+	unmapImage(img.mapped);
+}
+
+// Read an image from a file into planar form, with values from 0 to 255 like readImage.
+// If color == 0, only the intensity plane is filled in and r, g, and b are NULL.
+// If color == 0, an 8-bit PGM file read this way is not copied at all: its read-only file
+// mapping (see mapImage) becomes the intensity plane, so readOnly is set and this plane's
+// rows are not aligned in that case. Use image2Planar on a readImage result for planes that
+// can be written.
+PlanarImage readPlanarImage(char *filename, int color)
+{
+	int m, n;
+	size_t rowsize;
+	unsigned char *raw;
+	const unsigned char *src;
+	Pixel *row;
+	FILE *f;
+	Format filetype;
+	int width, height, imax;
+	PlanarImage img;
+
+	// Only an intensity plane is taken from the mapping, so planes of color images never
+	// alias each other. The mapping is read-only, and readOnly tells writers so.
+	img.mapped = mapImage(filename);
+	if (img.mapped.data != NULL && img.mapped.channels == 1 && !color)
+	{
+		img.height = img.mapped.height;
+		img.width = img.mapped.width;
+		img.stride = (ptrdiff_t) img.mapped.stride;
+		img.i = (unsigned char *) img.mapped.data;
+		img.r = img.g = img.b = NULL;
+		img.buffer = NULL;
+		img.readOnly = 1;
+		return img;
+	}
+	unmapImage(img.mapped);
+
+	// Decode the file row by row straight into the planes, without going through an Image.
+	f = openImageFile(filename, &filetype, &width, &height, &imax);
+	img = createPlanarImage(height, width, color);
+	rowsize = rasterRowSize(filetype, width);
+	raw = (unsigned char *) malloc(rowsize);
+	row = (Pixel *) malloc(sizeof(Pixel)*width);
+	for (m = 0; m < height; m++)
+	{
+		if (fread((void *) raw, 1, rowsize, f) != rowsize)
+		{
+			fprintf(stderr, "Data missing in file %s.\n", filename);
+			exit(1);
+		}
+		if (filetype == PPM && !color)
+		{
+			// Only the intensity is needed, so skip decoding r, g, and b.
+			for (n = 0, src = raw; n < width; n++, src += 3)
+				img.i[img.stride*m + n] = (unsigned char) (((int) src[0] + (int) src[1] + (int) src[2])*255/(3*imax));
+			continue;
+		}
+		decodeRow(raw, row, width, filetype, imax);
+		for (n = 0; n < width; n++)
+			img.i[img.stride*m + n] = row[n].i;
+		if (color)
+			for (n = 0; n < width; n++)
+			{
+				img.r[img.stride*m + n] = row[n].r;
+				img.g[img.stride*m + n] = row[n].g;
+				img.b[img.stride*m + n] = row[n].b;
+			}
+	}
+	fclose(f);
+	free(raw);
+	free(row);
+	return img;
+}
+
+// Convert an image into planar form. If color == 0, only the intensity plane is created.
+PlanarImage image2Planar(Image img, int color)
+{
+	int m, n;
+	Pixel *src;
+	PlanarImage result = createPlanarImage(img.height, img.width, color);
+
+	for (m = 0; m < img.height; m++)
+	{
+		src = img.map[m];
+		for (n = 0; n < img.width; n++)
+			result.i[result.stride*m + n] = src[n].i;
+		if (color)
+			for (n = 0; n < img.width; n++)
+			{
+				result.r[result.stride*m + n] = src[n].r;
+				result.g[result.stride*m + n] = src[n].g;
+				result.b[result.stride*m + n] = src[n].b;
+			}
+	}
+	return result;
+}
+
+// Convert a planar image into an image. For intensity-only planar images, the r, g, and b
+// components are set to the intensity.
+Image planar2Image(PlanarImage img)
+{
+	int m, n;
+	Pixel *dst;
+	Image result = createImage(img.height, img.width);
+
+	for (m = 0; m < img.height; m++)
+	{
+		dst = result.map[m];
+		for (n = 0; n < img.width; n++)
+			dst[n].r = dst[n].g = dst[n].b = dst[n].i = img.i[img.stride*m + n];
+		if (img.r != NULL)
+			for (n = 0; n < img.width; n++)
+			{
+				dst[n].r = img.r[img.stride*m + n];
+				dst[n].g = img.g[img.stride*m + n];
+				dst[n].b = img.b[img.stride*m + n];
+			}
+	}
+	return result;
+}
+
+// Get a view of one plane (img.r, img.g, img.b, or img.i) of a planar image.
+ChannelView planeView(PlanarImage img, const unsigned char *plane)
+{
+	ChannelView view;
+
+	view.height = img.height;
+	view.width = img.width;
+	view.data = plane;
+	view.stride = img.stride;
+	view.step = 1;
+	return view;
+}
 
 // Convert the intensity components of an image into a matrix of identical size.
 Matrix image2Matrix(Image img)
 {
 	int m, n;
 	Matrix result = createMatrix(img.height, img.width);
+	Pixel *src;
+	double *dst;
 
 	for (m = 0; m < img.height; m++)
+	{
+		src = img.map[m];
+		dst = result.map[m];
 		for (n = 0; n < img.width; n++)
-			result.map[m][n] = (double) img.map[m][n].i;
+			dst[n] = (double) src[n].i;
+	}
 	return result;
 }
 
@@ -305,42 +783,421 @@ Matrix image2Matrix(Image img)
 Image matrix2Image(Matrix mx, int scale, double gamma)
 {
 	int m, n, intValue;
-	double dblValue, minVal = DBL_MAX, maxVal = -DBL_MAX;
+	double dblValue, minVal = DBL_MAX, maxVal = -DBL_MAX, *src;
+	Pixel *dst;
 	Image result = createImage(mx.height, mx.width);
 
 	if (scale)
 	{
 		for (m = 0; m < mx.height; m++)
+		{
+			src = mx.map[m];
 			for (n = 0; n < mx.width; n++)
 			{
-				dblValue = mx.map[m][n];
+				dblValue = src[n];
 				if (dblValue < minVal)
 					minVal = dblValue;
 				else if (dblValue > maxVal)
 					maxVal = dblValue;
 			}
+		}
 		if (maxVal - minVal < 1e-10)
 			maxVal += 1.0;
 	}
 
 	//minVal = 0.0;
 	for (m = 0; m < mx.height; m++)
+	{
+		src = mx.map[m];
+		dst = result.map[m];
 		for (n = 0; n < mx.width; n++)
 		{
-			dblValue = mx.map[m][n];
+			dblValue = src[n];
 			if (scale)
 				intValue = (int) (255.0*pow((dblValue - minVal)/(maxVal - minVal), gamma) + 0.5);
 			else
-				intValue = (int) mx.map[m][n];
+				intValue = (int) dblValue;
 			if (intValue < 0)
 				intValue = 0;
 			else if (intValue > 255)
 				intValue = 255;
-			result.map[m][n].r = result.map[m][n].g = result.map[m][n].b = result.map[m][n].i = intValue;
+			dst[n].r = dst[n].g = dst[n].b = dst[n].i = intValue;
 		}
+	}
 	return result;
 }
 
+// Create a new 16-bit integer matrix of the given size and fill it with zeroes.
+// When you don't need the matrix anymore, don't forget to free its memory using deleteShortMatrix.
+ShortMatrix createShortMatrix(int height, int width)
+{
+	int i;
+	ShortMatrix mx;
+
+	mx.stride = (int) ((sizeof(short)*width + ALIGNMENT - 1)/ALIGNMENT*ALIGNMENT/sizeof(short));
+	mx.data = (short *) alignedMalloc(sizeof(short)*mx.stride*height);
+	mx.map = (short **) malloc(sizeof(short *)*height);
+	for (i = 0; i < height; i++)
+		mx.map[i] = mx.data + (size_t) mx.stride*i;
+	memset(mx.data, 0, sizeof(short)*mx.stride*height);
+	mx.height = height;
+	mx.width = width;
+	return mx;
+}
+
+// Delete a previously created 16-bit integer matrix and free its allocated memory on the heap.
+void deleteShortMatrix(ShortMatrix mx)
+{
+	alignedFree(mx.data);
+	free(mx.map);
+}
+
+// Create an integer convolution kernel of size x size weights, given row by row,
+// whose results are divided by 2^shift with rounding.
+IntKernel createIntKernel(const int *weights, int size, int shift)
+{
+	int i;
+	IntKernel k;
+
+	if (size < 1 || size > MAX_KERNEL_SIZE || size%2 == 0)
+	{
+		fprintf(stderr, "Invalid integer kernel size %d.\n", size);
+		exit(1);
+	}
+	memset(&k, 0, sizeof(k));
+	k.size = size;
+	k.shift = shift;
+	for (i = 0; i < size*size; i++)
+		k.weights[i] = (short) weights[i];
+	return k;
+}
+
+static const int sobelXWeights[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+static const int sobelYWeights[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+static const int binomialWeights[9] = {1, 2, 1, 2, 4, 2, 1, 2, 1};
+
+// The horizontal and vertical 3x3 Sobel kernels and the 3x3 binomial (Gaussian) kernel.
+// The binomial kernel sums to 16, so use shift 4 for a normalized result.
+IntKernel sobelXKernel(void) { return createIntKernel(sobelXWeights, 3, 0); }
+IntKernel sobelYKernel(void) { return createIntKernel(sobelYWeights, 3, 0); }
+IntKernel binomialKernel(int shift) { return createIntKernel(binomialWeights, 3, shift); }
+
+// Inner loop of the integer convolution for one output row. It is instantiated for each source
+// type and for the common kernel sizes, and with fixed weights for the kernels above, so that the
+// compiler can unroll the kernel loops, drop zero weights, and vectorize along the row.
+// Sums are accumulated in 32 bits and saturated to 16 bits.
+#define CONVOLVE_ROW(NAME, TYPE, SIZE, WEIGHTS) \
+static void NAME(const TYPE **rows, const int *w, int size, int shift, short *dst, int width) \
+{ \
+	int x, m, n, acc, half = (SIZE)/2, round = (1 << shift) >> 1; \
+	(void)size; (void)w; \
+	for (x = half; x < width - half; x++) \
+	{ \
+		acc = 0; \
+		for (m = 0; m < (SIZE); m++) \
+			for (n = 0; n < (SIZE); n++) \
+				acc += (WEIGHTS)[m*(SIZE) + n]*(int) rows[m][x - half + n]; \
+		acc = (acc + round) >> shift; \
+		dst[x] = (short) (acc < -32768? -32768 : acc > 32767? 32767 : acc); \
+	} \
+}
+
+CONVOLVE_ROW(convolveRowU8, unsigned char, size, w)
+CONVOLVE_ROW(convolveRowU8x3, unsigned char, 3, w)
+CONVOLVE_ROW(convolveRowU8x5, unsigned char, 5, w)
+CONVOLVE_ROW(convolveRowU8SobelX, unsigned char, 3, sobelXWeights)
+CONVOLVE_ROW(convolveRowU8SobelY, unsigned char, 3, sobelYWeights)
+CONVOLVE_ROW(convolveRowU8Binomial, unsigned char, 3, binomialWeights)
+CONVOLVE_ROW(convolveRowS16, short, size, w)
+CONVOLVE_ROW(convolveRowS16x3, short, 3, w)
+CONVOLVE_ROW(convolveRowS16x5, short, 5, w)
+CONVOLVE_ROW(convolveRowS16SobelX, short, 3, sobelXWeights)
+CONVOLVE_ROW(convolveRowS16SobelY, short, 3, sobelYWeights)
+CONVOLVE_ROW(convolveRowS16Binomial, short, 3, binomialWeights)
+
+// Check whether a kernel has the given fixed 3x3 weights.
+static int hasWeights(IntKernel k, const int *weights)
+{
+	int i;
+
+	if (k.size != 3)
+		return 0;
+	for (i = 0; i < 9; i++)
+		if (k.weights[i] != weights[i])
+			return 0;
+	return 1;
+}
+
+// Convolve rows first to first + count - 1 of an 8-bit channel with an integer kernel, writing
+// row y of the result to out[y - first]. Like convolve in the edge detectors, this sets entries
+// for which the kernel does not fit into the channel to 0, and as long as the results fit into
+// 16 bits, they are identical to those of convolve on the corresponding double matrix.
+void convolveChannelRows(ChannelView view, IntKernel k, int first, int count, short **out)
+{
+	int y, m, n, top, bottom, half = k.size/2, w[MAX_KERNEL_SIZE*MAX_KERNEL_SIZE];
+	const unsigned char *rows[MAX_KERNEL_SIZE];
+	unsigned char *copy = NULL;
+	void (*convolveRow)(const unsigned char **, const int *, int, int, short *, int) = convolveRowU8;
+
+	for (m = 0; m < k.size*k.size; m++)
+		w[m] = k.weights[m];
+	if (hasWeights(k, sobelXWeights))
+		convolveRow = convolveRowU8SobelX;
+	else if (hasWeights(k, sobelYWeights))
+		convolveRow = convolveRowU8SobelY;
+	else if (hasWeights(k, binomialWeights))
+		convolveRow = convolveRowU8Binomial;
+	else if (k.size == 3)
+		convolveRow = convolveRowU8x3;
+	else if (k.size == 5)
+		convolveRow = convolveRowU8x5;
+
+	// Interleaved channels are copied into contiguous rows first, so that the inner loop has unit stride.
+	// Only the rows that the requested output rows read are copied, from row top on.
+	top = MAX(first - half, 0);
+	bottom = MIN(first + count + half, view.height);
+	if (view.step != 1 && bottom > top)
+	{
+		copy = (unsigned char *) alignedMalloc((size_t) view.width*(bottom - top));
+		for (m = top; m < bottom; m++)
+			for (n = 0; n < view.width; n++)
+				copy[(size_t) view.width*(m - top) + n] = view.data[view.stride*m + (ptrdiff_t) view.step*n];
+		view.data = copy;
+		view.stride = view.width;
+		view.step = 1;
+	}
+	else
+		top = 0;
+	for (y = first; y < first + count; y++)
+	{
+		memset(out[y - first], 0, sizeof(short)*view.width);
+		if (y < half || y >= view.height - half)
+			continue;
+		for (m = 0; m < k.size; m++)
+			rows[m] = view.data + view.stride*(y - half + m - top);
+		convolveRow(rows, w, k.size, k.shift, out[y - first], view.width);
+	}
+	alignedFree(copy);
+}
+
+// Convolve an 8-bit channel with an integer kernel into a new 16-bit matrix of identical size.
+// Entries for which the kernel does not fit into the channel are set to 0.
+ShortMatrix convolveChannel(ChannelView view, IntKernel k)
+{
+	ShortMatrix result = createShortMatrix(view.height, view.width);
+
+	convolveChannelRows(view, k, 0, view.height, result.map);
+	return result;
+}
+
+// Convolve a 16-bit matrix with an integer kernel into a new 16-bit matrix of identical size.
+// Entries for which the kernel does not fit into the matrix are set to 0.
+ShortMatrix convolveShort(ShortMatrix mx, IntKernel k)
+{
+	int y, m, half = k.size/2, w[MAX_KERNEL_SIZE*MAX_KERNEL_SIZE];
+	const short *rows[MAX_KERNEL_SIZE];
+	ShortMatrix result = createShortMatrix(mx.height, mx.width);
+	void (*convolveRow)(const short **, const int *, int, int, short *, int) = convolveRowS16;
+
+	for (m = 0; m < k.size*k.size; m++)
+		w[m] = k.weights[m];
+	if (hasWeights(k, sobelXWeights))
+		convolveRow = convolveRowS16SobelX;
+	else if (hasWeights(k, sobelYWeights))
+		convolveRow = convolveRowS16SobelY;
+	else if (hasWeights(k, binomialWeights))
+		convolveRow = convolveRowS16Binomial;
+	else if (k.size == 3)
+		convolveRow = convolveRowS16x3;
+	else if (k.size == 5)
+		convolveRow = convolveRowS16x5;
+
+	for (y = half; y < mx.height - half; y++)
+	{
+		for (m = 0; m < k.size; m++)
+			rows[m] = mx.map[y - half + m];
+		convolveRow(rows, w, k.size, k.shift, result.map[y], mx.width);
+	}
+	return result;
+}
+
+// Convert a 16-bit integer matrix into a double matrix of identical size.
+Matrix short2Matrix(ShortMatrix mx)
+{
+	int m, n;
+	Matrix result = createMatrix(mx.height, mx.width);
+
+	for (m = 0; m < mx.height; m++)
+		for (n = 0; n < mx.width; n++)
+			result.map[m][n] = (double) mx.map[m][n];
+	return result;
+}
+
+// Get the number of processors available to run threads on (at least 1).
+int processorCount(void)
+{
+#ifdef _WIN32
+	return 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return count > 0 ? (int) count : 1;
+#endif
+}
+
+// A pool of worker threads. The workers sleep until generation changes, which starts a loop, and
+// then take the next task index under the lock, like the calling thread; busy counts the workers
+// that have not finished the current loop yet.
+struct ThreadPool
+{
+	int threads;
+#ifndef _WIN32
+	void (*task)(void *arg, int k);
+	void *arg;
+	int count, next, generation, busy, quit;
+	pthread_t *ids;
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+#endif
+};
+
+#ifndef _WIN32
+// Run the remaining tasks of the current loop of a pool. The lock is held on entry and on return.
+static void runPoolTasks(ThreadPool *pool)
+{
+	int k;
+
+	while (pool->next < pool->count)
+	{
+		k = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		pool->task(pool->arg, k);
+		pthread_mutex_lock(&pool->lock);
+	}
+}
+
+static void *poolWorker(void *ptr)
+{
+	ThreadPool *pool = (ThreadPool *) ptr;
+	int seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;)
+	{
+		while (pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->quit)
+			break;
+		seen = pool->generation;
+		runPoolTasks(pool);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+#endif
+
+// Create a pool of up to threads threads (0 for one per processor), counting the calling thread,
+// which takes part in every loop run on the pool. Without thread support, loops run in order.
+// When you don't need the pool anymore, don't forget to stop it using deleteThreadPool.
+ThreadPool *createThreadPool(int threads)
+{
+	ThreadPool *pool = (ThreadPool *) calloc(1, sizeof(ThreadPool));
+
+	if (pool == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	if (threads <= 0)
+		threads = processorCount();
+	pool->threads = 1;
+#ifndef _WIN32
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->ids = (pthread_t *) malloc(sizeof(pthread_t)*threads);
+	// The calling thread is the first worker; if fewer threads can be started, the rest takes longer.
+	for (pool->threads = 1; pool->threads < threads; pool->threads++)
+		if (pthread_create(&pool->ids[pool->threads], NULL, poolWorker, pool) != 0)
+			break;
+#endif
+	return pool;
+}
+
+// Call task(arg, k) for k = 0 to count - 1 on the threads of a pool and return when all calls
+// are done. Each thread takes the next index as soon as it is free, as in parallelFor.
+// Only one loop at a time may run on a pool.
+void runThreadPool(ThreadPool *pool, int count, void (*task)(void *arg, int k), void *arg)
+{
+	int k;
+
+#ifndef _WIN32
+	if (pool->threads > 1 && count > 1)
+	{
+		pthread_mutex_lock(&pool->lock);
+		pool->task = task;
+		pool->arg = arg;
+		pool->count = count;
+		pool->next = 0;
+		pool->busy = pool->threads - 1;
+		pool->generation++;
+		pthread_cond_broadcast(&pool->wake);
+		runPoolTasks(pool);
+		while (pool->busy > 0)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+#endif
+	for (k = 0; k < count; k++)
+		task(arg, k);
+}
+
+// Stop the threads of a pool and free its memory.
+void deleteThreadPool(ThreadPool *pool)
+{
+#ifndef _WIN32
+	int t;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (t = 1; t < pool->threads; t++)
+		pthread_join(pool->ids[t], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->done);
+	free(pool->ids);
+#endif
+	free(pool);
+}
+
+// Call task(arg, k) for k = 0 to count - 1 on a pool of up to threads threads (0 for one per
+// processor) and return when all calls are done. Each thread takes the next index as soon as it
+// is free, so tasks of unequal cost balance out. Without thread support, the calls run in order.
+// The threads are started for this call only; use a ThreadPool to run several loops in a row.
+void parallelFor(int count, int threads, void (*task)(void *arg, int k), void *arg)
+{
+	int k;
+	ThreadPool *pool;
+
+	if (threads <= 0)
+		threads = processorCount();
+	threads = MIN(threads, count);
+	if (threads <= 1)
+	{
+		for (k = 0; k < count; k++)
+			task(arg, k);
+		return;
+	}
+	pool = createThreadPool(threads);
+	runThreadPool(pool, count, task, arg);
+	deleteThreadPool(pool);
+}
+
 // Set color for pixel (vPos, hPos) in image img.
 // If r, g, b, or i are set to NO_CHANGE, the corresponding color channels are left unchanged in img.
 // If they are set to INVERT, the corresponding channels are inverted, i.e., set to 255 minus their original value
@@ -3,164 +3,1083 @@
 #include <stdlib.h>
 #include <math.h>
 #include <float.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define BLOCK_SIZE 4
+#define MAX_EXTRACTORS 8
+#define LBP_BINS 10         //uniform rotation invariant patterns with 0..8 bits set, and all others
+#define GABOR_SCALES 2
+#define GABOR_ORIENTATIONS 4
+#define GABOR_FILTERS (GABOR_SCALES*GABOR_ORIENTATIONS)
+#define TABLE_BAND 64       //rows per task of the row pass of summed-area tables
+#define TABLE_STRIPE 4096   //entries per task of their column pass
+#define GABOR_BAND 128      //rows per task of the gabor filter bank
+#define KMEANS_CHUNK 4096   //feature vectors per k-means task
+#define CENTER_LANES 8      //centers whose distances are computed side by side
 
+//feature vectors of all blocks as a structure of arrays: feature j of vector i is at values[j*count+i],
+//so each feature is one contiguous stream
 typedef struct {
-    float mean;
-    float stddev;
-    float x;
-    float y;
-} feature_vec;
+    int count;
+    int dims;
+    float* values;
+} feature_set;
 
-//funct to segment textures
-Image segment_texture(Image inp_img, int segments) {
-    int width=inp_img.width;
-    int height=inp_img.height;
-    int block_idx= 0;
+//summed-area tables of the intensities and their squares: entry [y*(width+1)+x] holds the sums over all
+//pixels above and left of (y,x), row 0 and column 0 being zero, so the sums over any rectangle take 4 lookups
+typedef struct {
+    int height;
+    int width;
+    unsigned long long* sum;
+    unsigned long long* sum_sq;
+} integral_image;
+
+//summed-area tables are built in two passes that both run in parallel: the row pass writes the running sums
+//along each row, bands of TABLE_BAND rows per task, then the column pass adds each row to the one below, stripes
+//of TABLE_STRIPE entries per task - every entry gets the same sum as when adding the row above on the way
+
+//shared state of the column pass over a summed-area table of height+1 rows of row entries, row 0 being zero
+typedef struct {
+    void* table;
+    int height;
+    size_t row;
+} column_pass;
+
+//funct to add up the rows of the entries in stripe k of a summed-area table
+#define COLUMN_PASS(NAME, TYPE) \
+static void NAME(void* arg, int k) { \
+    const column_pass* p=(const column_pass*)arg; \
+    size_t first=(size_t)k*TABLE_STRIPE, last=MIN(first+TABLE_STRIPE, p->row); \
+    for(int m=2; m<=p->height; m++) { \
+        TYPE* cur=(TYPE*)p->table+(size_t)m*p->row; \
+        const TYPE* above=cur-p->row; \
+        for(size_t e=first; e<last; e++) \
+            cur[e]+=above[e]; \
+    } \
+}
+
+COLUMN_PASS(column_pass_ull, unsigned long long)
+COLUMN_PASS(column_pass_uint, unsigned int)
+COLUMN_PASS(column_pass_double, double)
+
+//funct to run the column pass over a summed-area table with the given number of threads
+static void add_columns(void (*pass)(void*, int), void* table, int height, size_t row, int threads) {
+    column_pass p={table, height, row};
+    parallelFor((int)((row+TABLE_STRIPE-1)/TABLE_STRIPE), threads, pass, &p);
+}
+
+//funct to get the number of row pass tasks of an image
+static int table_bands(Image img) {
+    return (img.height+TABLE_BAND-1)/TABLE_BAND;
+}
+
+//shared state of the row pass of the summed-area tables of an image
+typedef struct {
+    Image img;
+    integral_image* ii;
+} integral_rows;
+
+//funct for the running sums along the rows of band k
+static void integral_band(void* arg, int k) {
+    const integral_rows* r=(const integral_rows*)arg;
+    int stride=r->img.width+1, last=MIN((k+1)*TABLE_BAND, r->img.height);
+    for(int m=k*TABLE_BAND; m<last; m++) {
+        unsigned long long row_sum=0, row_sum_sq=0;
+        unsigned long long* cur=r->ii->sum+(size_t)(m+1)*stride;
+        unsigned long long* cur_sq=r->ii->sum_sq+(size_t)(m+1)*stride;
+        for(int n=0; n<r->img.width; n++) {
+            unsigned int pixel=r->img.map[m][n].i;
+            row_sum+=pixel;
+            row_sum_sq+=pixel*pixel;
+            cur[n+1]=row_sum;
+            cur_sq[n+1]=row_sum_sq;
+        }
+    }
+}
+
+//funct to build the summed-area tables of an image with the given number of threads
+integral_image create_integral_image(Image img, int threads) {
+    integral_image ii;
+    int stride=img.width+1;
+    ii.height=img.height;
+    ii.width=img.width;
+    ii.sum=(unsigned long long*)calloc((size_t)(img.height+1)*stride, sizeof(unsigned long long));
+    ii.sum_sq=(unsigned long long*)calloc((size_t)(img.height+1)*stride, sizeof(unsigned long long));
+    if(ii.sum==NULL || ii.sum_sq==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+
+    integral_rows r={img, &ii};
+    parallelFor(table_bands(img), threads, integral_band, &r);
+    add_columns(column_pass_ull, ii.sum, img.height, stride, threads);
+    add_columns(column_pass_ull, ii.sum_sq, img.height, stride, threads);
+    return ii;
+}
+
+void free_integral_image(integral_image ii) {
+    free(ii.sum);
+    free(ii.sum_sq);
+}
+
+//funct to get mean and stddev of the pixels in rows y0..y1-1 and columns x0..x1-1, clipped to the image
+void block_stats(integral_image ii, int y0, int x0, int y1, int x1, double* mean, double* stddev) {
+    int stride=ii.width+1;
+    y0=y0<0 ? 0 : y0;
+    x0=x0<0 ? 0 : x0;
+    y1=y1>ii.height ? ii.height : y1;
+    x1=x1>ii.width ? ii.width : x1;
+    int count=(y1-y0)*(x1-x0);
+
+    size_t a=(size_t)y0*stride+x0, b=(size_t)y0*stride+x1, c=(size_t)y1*stride+x0, d=(size_t)y1*stride+x1;
+    double sum=(double)(ii.sum[d]-ii.sum[b]-ii.sum[c]+ii.sum[a]);
+    double sum_sq=(double)(ii.sum_sq[d]-ii.sum_sq[b]-ii.sum_sq[c]+ii.sum_sq[a]);
+    *mean=sum/count;
+    double variance=(sum_sq/count)-(*mean)*(*mean);
+    *stddev=sqrt(variance);
+}
+
+//a feature extractor adds dims features to each block: prepare builds tables of the whole image - once, and
+//shared by all blocks - from which block computes the features of the block in rows y0..y1-1 and columns
+//x0..x1-1 in constant time; features are scaled to be comparable with gray levels
+typedef struct {
+    const char* name;
+    int dims;
+    const char* const* feature_names;
+    void* (*prepare)(Image img, int threads);
+    void (*block)(const void* tables, int y0, int x0, int y1, int x1, float* out);
+    void (*release)(void* tables);
+} feature_extractor;
+
+//mean and stddev of the intensities, from the summed-area tables
+static void* stats_prepare(Image img, int threads) {
+    integral_image* ii=(integral_image*)malloc(sizeof(integral_image));
+    *ii=create_integral_image(img, threads);
+    return ii;
+}
+
+static void stats_block(const void* tables, int y0, int x0, int y1, int x1, float* out) {
+    double mean, stddev;
+    block_stats(*(const integral_image*)tables, y0, x0, y1, x1, &mean, &stddev);
+    out[0]=(float)mean;
+    out[1]=(float)stddev;
+}
+
+static void stats_release(void* tables) {
+    free_integral_image(*(integral_image*)tables);
+    free(tables);
+}
+
+//integral histogram of local binary patterns: every pixel compares its 8 neighbours with itself, and the
+//pattern is binned by the number of neighbours at least as bright if it is uniform - 2 or less changes around
+//the circle - else into the last bin; entry [(y*(width+1)+x)*LBP_BINS+b] counts the pixels above and left of
+//(y,x) in bin b, so a block histogram takes 4 lookups per bin
+typedef struct {
+    int height;
+    int width;
+    unsigned int* counts;
+} lbp_tables;
+
+//shared state of the row pass of the LBP tables; bin maps each pattern to its bin
+typedef struct {
+    Image img;
+    lbp_tables* t;
+    const unsigned char* bin;
+} lbp_rows;
+
+//funct for the patterns of the pixels of band k and their running counts along the rows
+static void lbp_band(void* arg, int k) {
+    static const int dy[8]={-1, -1, -1, 0, 1, 1, 1, 0}, dx[8]={-1, 0, 1, 1, 1, 0, -1, -1}; //around the circle
+    const lbp_rows* r=(const lbp_rows*)arg;
+    Image img=r->img;
+    size_t row=(size_t)(img.width+1)*LBP_BINS;
+    int last=MIN((k+1)*TABLE_BAND, img.height);
+    for(int m=k*TABLE_BAND; m<last; m++) {
+        unsigned int run[LBP_BINS]={0};
+        unsigned int* cur=r->t->counts+(m+1)*row;
+        for(int n=0; n<img.width; n++) {
+            int center=img.map[m][n].i, code=0;
+            for(int p=0; p<8; p++) {
+                //clamped at the border
+                int y=MIN(MAX(m+dy[p], 0), img.height-1), x=MIN(MAX(n+dx[p], 0), img.width-1);
+                code|=(img.map[y][x].i>=center)<<p;
+            }
+            run[r->bin[code]]++;
+            for(int b=0; b<LBP_BINS; b++)
+                cur[(n+1)*LBP_BINS+b]=run[b];
+        }
+    }
+}
+
+static void* lbp_prepare(Image img, int threads) {
+    lbp_tables* t=(lbp_tables*)malloc(sizeof(lbp_tables));
+    size_t row=(size_t)(img.width+1)*LBP_BINS;
+    t->height=img.height;
+    t->width=img.width;
+    t->counts=(unsigned int*)calloc((img.height+1)*row, sizeof(unsigned int));
+    if(t->counts==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+
+    unsigned char bin[256];
+    for(int code=0; code<256; code++) {
+        int ones=0, changes=0;
+        for(int b=0; b<8; b++) {
+            ones+=code>>b & 1;
+            changes+=(code>>b & 1)!=(code>>((b+1)%8) & 1);
+        }
+        bin[code]=changes<=2 ? ones : LBP_BINS-1;
+    }
+
+    lbp_rows r={img, t, bin};
+    parallelFor(table_bands(img), threads, lbp_band, &r);
+    add_columns(column_pass_uint, t->counts, img.height, row, threads);
+    return t;
+}
+
+//the histogram in percent of the block
+static void lbp_block(const void* tables, int y0, int x0, int y1, int x1, float* out) {
+    const lbp_tables* t=(const lbp_tables*)tables;
+    size_t row=(size_t)(t->width+1)*LBP_BINS;
+    const unsigned int *a=t->counts+y0*row+x0*LBP_BINS, *b=t->counts+y0*row+x1*LBP_BINS;
+    const unsigned int *c=t->counts+y1*row+x0*LBP_BINS, *d=t->counts+y1*row+x1*LBP_BINS;
+    float scale=100.0f/((y1-y0)*(x1-x0));
+    for(int k=0; k<LBP_BINS; k++)
+        out[k]=(d[k]-b[k]-c[k]+a[k])*scale;
+}
+
+static void lbp_release(void* tables) {
+    free(((lbp_tables*)tables)->counts);
+    free(tables);
+}
+
+//co-occurrence statistics of horizontally neighbouring pixels (i,j), counted both ways: summed-area tables of
+//i+j, i*i+j*j, i*j and 1/(1+|i-j|) over the pairs whose left pixel is at (y,x), 4 per entry; contrast,
+//homogeneity and correlation of the symmetric co-occurrence matrix of a block are linear in these, so they take
+//no histogram of pairs
+typedef struct {
+    int height;
+    int width;
+    double* sums;
+} glcm_tables;
+
+//shared state of the row pass of the co-occurrence tables
+typedef struct {
+    Image img;
+    glcm_tables* t;
+} glcm_rows;
+
+//funct for the running sums of the pairs of band k along the rows
+static void glcm_band(void* arg, int k) {
+    const glcm_rows* r=(const glcm_rows*)arg;
+    Image img=r->img;
+    size_t row=(size_t)(img.width+1)*4;
+    int last=MIN((k+1)*TABLE_BAND, img.height);
+    for(int m=k*TABLE_BAND; m<last; m++) {
+        double run[4]={0.0};
+        double* cur=r->t->sums+(m+1)*row;
+        for(int n=0; n<img.width; n++) {
+            if(n+1<img.width) {
+                int i=img.map[m][n].i, j=img.map[m][n+1].i;
+                run[0]+=i+j;
+                run[1]+=i*i+j*j;
+                run[2]+=i*j;
+                run[3]+=1.0/(1+abs(i-j));
+            }
+            for(int s=0; s<4; s++)
+                cur[(n+1)*4+s]=run[s];
+        }
+    }
+}
+
+static void* glcm_prepare(Image img, int threads) {
+    glcm_tables* t=(glcm_tables*)malloc(sizeof(glcm_tables));
+    size_t row=(size_t)(img.width+1)*4;
+    t->height=img.height;
+    t->width=img.width;
+    t->sums=(double*)calloc((img.height+1)*row, sizeof(double));
+    if(t->sums==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+
+    glcm_rows r={img, t};
+    parallelFor(table_bands(img), threads, glcm_band, &r);
+    add_columns(column_pass_double, t->sums, img.height, row, threads);
+    return t;
+}
+
+//contrast as the RMS difference of the pairs, homogeneity and correlation in percent
+static void glcm_block(const void* tables, int y0, int x0, int y1, int x1, float* out) {
+    const glcm_tables* t=(const glcm_tables*)tables;
+    x1--; //pairs that lie in the block
+    if(x1<=x0) {
+        out[0]=0.0f;
+        out[1]=100.0f;
+        out[2]=100.0f;
+        return;
+    }
+    size_t row=(size_t)(t->width+1)*4;
+    const double *a=t->sums+y0*row+x0*4, *b=t->sums+y0*row+x1*4;
+    const double *c=t->sums+y1*row+x0*4, *d=t->sums+y1*row+x1*4;
+    double sum[4];
+    for(int k=0; k<4; k++)
+        sum[k]=d[k]-b[k]-c[k]+a[k];
+
+    double pairs=(double)(y1-y0)*(x1-x0);
+    double mean=sum[0]/(2*pairs), variance=sum[1]/(2*pairs)-mean*mean;
+    double contrast=(sum[1]-2*sum[2])/pairs;
+    out[0]=(float)sqrt(contrast>0.0 ? contrast : 0.0);
+    out[1]=(float)(100.0*sum[3]/pairs);
+    out[2]=variance>1e-9 ? (float)(100.0*(sum[2]/pairs-mean*mean)/variance) : 100.0f;
+}
+
+static void glcm_release(void* tables) {
+    free(((glcm_tables*)tables)->sums);
+    free(tables);
+}
+
+//gabor filter bank energies: complex gabor filters of GABOR_SCALES wavelengths and GABOR_ORIENTATIONS
+//orientations, whose envelope is an isotropic gaussian, factor into a row and a column filter for any
+//orientation, so each takes two 1D passes; the DC response is taken out with the gaussian blur of the same
+//scale, separable too. The energy - squared magnitude - of each response goes into summed-area tables,
+//GABOR_FILTERS per entry
+//the bank runs on bands of GABOR_BAND rows, each filtering the rows it needs around it again, so the filter
+//responses are only ever held for one band per thread and the tables take the bulk of the memory
+static const double gabor_wavelengths[GABOR_SCALES]={4.0, 8.0};
+
+typedef struct {
+    int height;
+    int width;
+    double* energy;
+} gabor_tables;
+
+//the 1D kernels of the bank, taps -radius..radius of each scale: the gaussian blur, and for each filter the
+//real and imaginary row and column kernels, with the DC gain of the filter
+typedef struct {
+    int radius[GABOR_SCALES];
+    float* gauss[GABOR_SCALES];
+    float* zero[GABOR_SCALES];
+    float* kernels[GABOR_FILTERS]; //row_re, row_im, col_re, col_im
+    float dc_re[GABOR_FILTERS], dc_im[GABOR_FILTERS];
+} gabor_bank;
 
-    int block_col=(width+BLOCK_SIZE-1)/BLOCK_SIZE;
-    int block_row=(height+BLOCK_SIZE-1)/BLOCK_SIZE;
-    int block_total=block_col*block_row;
-    feature_vec* features=(feature_vec*)malloc(block_total*sizeof(feature_vec));
+//funct to build the kernels of the gabor filter bank
+static gabor_bank create_gabor_bank(void) {
+    gabor_bank g;
+    for(int s=0; s<GABOR_SCALES; s++) {
+        double lambda=gabor_wavelengths[s], sigma=0.56*lambda; //about one octave of bandwidth
+        int radius=(int)ceil(3*sigma), taps=2*radius+1;
+        float *gauss=(float*)malloc(taps*sizeof(float)), *zero=(float*)calloc(taps, sizeof(float));
+        double total=0.0;
+        for(int x=-radius; x<=radius; x++)
+            total+=exp(-x*x/(2*sigma*sigma));
+        for(int x=-radius; x<=radius; x++)
+            gauss[x+radius]=(float)(exp(-x*x/(2*sigma*sigma))/total);
+        g.radius[s]=radius;
+        g.gauss[s]=gauss;
+        g.zero[s]=zero;
 
-    if(features==NULL) {
+        for(int o=0; o<GABOR_ORIENTATIONS; o++) {
+            int f=s*GABOR_ORIENTATIONS+o;
+            float *row_re=(float*)malloc(4*taps*sizeof(float)), *row_im=row_re+taps, *col_re=row_re+2*taps, *col_im=row_re+3*taps;
+            double theta=o*M_PI/GABOR_ORIENTATIONS, omega=2*M_PI/lambda;
+            double row_sum_re=0.0, row_sum_im=0.0, col_sum_re=0.0, col_sum_im=0.0;
+            for(int x=-radius; x<=radius; x++) {
+                row_re[x+radius]=(float)(gauss[x+radius]*cos(omega*x*cos(theta)));
+                row_im[x+radius]=(float)(gauss[x+radius]*sin(omega*x*cos(theta)));
+                col_re[x+radius]=(float)(gauss[x+radius]*cos(omega*x*sin(theta)));
+                col_im[x+radius]=(float)(gauss[x+radius]*sin(omega*x*sin(theta)));
+                row_sum_re+=row_re[x+radius];
+                row_sum_im+=row_im[x+radius];
+                col_sum_re+=col_re[x+radius];
+                col_sum_im+=col_im[x+radius];
+            }
+            //DC gain of the filter, taken out with the blur
+            g.dc_re[f]=(float)(row_sum_re*col_sum_re-row_sum_im*col_sum_im);
+            g.dc_im[f]=(float)(row_sum_re*col_sum_im+row_sum_im*col_sum_re);
+            g.kernels[f]=row_re;
+        }
+    }
+    return g;
+}
+
+static void free_gabor_bank(gabor_bank g) {
+    for(int s=0; s<GABOR_SCALES; s++) {
+        free(g.gauss[s]);
+        free(g.zero[s]);
+    }
+    for(int f=0; f<GABOR_FILTERS; f++)
+        free(g.kernels[f]);
+}
+
+//a complex 1D filter pass over some rows of a frame of the given size, with taps -radius..radius clamped at
+//the frame border; the planes hold the rows of a band, from row in_base and out_base on
+typedef struct {
+    const float *in_re, *in_im; //in_im NULL - real input
+    int in_base;
+    float *out_re, *out_im;
+    int out_base;
+    int height, width;
+    const float *k_re, *k_im;
+    int radius;
+    int vertical;
+} filter_pass;
+
+//funct to filter rows first..last-1 with the complex kernel of a pass
+static void filter_rows(const filter_pass* f, int first, int last) {
+    for(int y=first; y<last; y++) {
+        for(int x=0; x<f->width; x++) {
+            float re=0.0f, im=0.0f;
+            for(int t=-f->radius; t<=f->radius; t++) {
+                size_t at=f->vertical ? (size_t)(MIN(MAX(y+t, 0), f->height-1)-f->in_base)*f->width+x
+                                      : (size_t)(y-f->in_base)*f->width+MIN(MAX(x+t, 0), f->width-1);
+                float kr=f->k_re[t+f->radius], ki=f->k_im[t+f->radius];
+                float vr=f->in_re[at], vi=f->in_im ? f->in_im[at] : 0.0f;
+                re+=kr*vr-ki*vi;
+                im+=kr*vi+ki*vr;
+            }
+            f->out_re[(size_t)(y-f->out_base)*f->width+x]=re;
+            f->out_im[(size_t)(y-f->out_base)*f->width+x]=im;
+        }
+    }
+}
+
+//funct to filter rows first..last-1 of a frame with the separable complex kernel rows x cols, the input holding
+//the rows from in_base on; the row pass covers the rows the column pass needs, into tmp from row
+//MAX(first-radius, 0) on, and the output gets the rows from first on
+static void separable_filter(const float* in, int in_base, int height, int width, int first, int last,
+                             const float* row_re, const float* row_im, const float* col_re, const float* col_im,
+                             int radius, float* tmp_re, float* tmp_im, float* out_re, float* out_im) {
+    int lo=MAX(first-radius, 0), hi=MIN(last+radius, height);
+    filter_pass rows={in, NULL, in_base, tmp_re, tmp_im, lo, height, width, row_re, row_im, radius, 0};
+    filter_rows(&rows, lo, hi);
+    filter_pass cols={tmp_re, tmp_im, lo, out_re, out_im, first, height, width, col_re, col_im, radius, 1};
+    filter_rows(&cols, first, last);
+}
+
+//shared state of the gabor filter bank on bands of GABOR_BAND rows
+typedef struct {
+    Image img;
+    gabor_tables* t;
+    const gabor_bank* bank;
+    int halo; //largest radius of the bank
+} gabor_rows;
+
+//funct for the responses of all filters on band k and the running sums of their energies along the rows
+static void gabor_band(void* arg, int k) {
+    const gabor_rows* r=(const gabor_rows*)arg;
+    const gabor_bank* g=r->bank;
+    Image img=r->img;
+    int height=img.height, width=img.width, first=k*GABOR_BAND, last=MIN(first+GABOR_BAND, height);
+    int lo=MAX(first-r->halo, 0), hi=MIN(last+r->halo, height);
+    size_t row=(size_t)(width+1)*GABOR_FILTERS, band=(size_t)(last-first)*width, window=(size_t)(hi-lo)*width;
+    float* buf=(float*)malloc((3*window+4*band)*sizeof(float));
+    if(buf==NULL) {
         fprintf(stderr, "Memory allocation error\n");
         exit(1);
     }
+    float *in=buf, *tmp_re=buf+window, *tmp_im=buf+2*window;
+    float *re=buf+3*window, *im=re+band, *blur=re+2*band, *blur_im=re+3*band;
+    for(int m=lo; m<hi; m++)
+        for(int n=0; n<width; n++)
+            in[(size_t)(m-lo)*width+n]=img.map[m][n].i;
 
-    //compute features for each block
-    int by, bx, m,n;
-    for(by=0; by<block_row; by++) {
-        for(bx=0; bx<block_col; bx++) {
-            int x0=bx*BLOCK_SIZE;
-            int y0=by*BLOCK_SIZE;
-            double sum=0.0;
-            double sum_sq=0.0;
-            int count=0;
-            for(m=y0; m<y0+BLOCK_SIZE && m<height; m++) {
-                for(n=x0; n<x0+BLOCK_SIZE && n<width; n++) {
-                    unsigned char pixel=inp_img.map[m][n].i;
-                    sum+=pixel;
-                    sum_sq+=pixel*pixel;
-                    count++;
+    for(int s=0; s<GABOR_SCALES; s++) {
+        int radius=g->radius[s];
+        separable_filter(in, lo, height, width, first, last, g->gauss[s], g->zero[s], g->gauss[s], g->zero[s], radius,
+                         tmp_re, tmp_im, blur, blur_im);
+        for(int o=0; o<GABOR_ORIENTATIONS; o++) {
+            int f=s*GABOR_ORIENTATIONS+o, taps=2*radius+1;
+            const float* kernel=g->kernels[f];
+            separable_filter(in, lo, height, width, first, last, kernel, kernel+taps, kernel+2*taps, kernel+3*taps,
+                             radius, tmp_re, tmp_im, re, im);
+            for(int m=first; m<last; m++) {
+                double run=0.0;
+                double* cur=r->t->energy+(m+1)*row;
+                for(int n=0; n<width; n++) {
+                    size_t at=(size_t)(m-first)*width+n;
+                    float rr=re[at]-g->dc_re[f]*blur[at], ii=im[at]-g->dc_im[f]*blur[at];
+                    run+=rr*rr+ii*ii;
+                    cur[(n+1)*GABOR_FILTERS+f]=run;
                 }
             }
-            double mean=sum/count;
-            double variance=(sum_sq/count)-(mean*mean);
-            double stddev=sqrt(variance);
-
-            features[block_idx].mean=(float)mean;
-            features[block_idx].stddev=(float)stddev;
-            features[block_idx].x=(float)(x0+BLOCK_SIZE/2)/width;
-            features[block_idx].y=(float)(y0+BLOCK_SIZE/2)/height;
-            block_idx++;
         }
     }
+    free(buf);
+}
 
-    //kmeans clustering
-    int k=segments;
-    int max_itr=100;
+static void* gabor_prepare(Image img, int threads) {
+    gabor_tables* t=(gabor_tables*)malloc(sizeof(gabor_tables));
+    size_t row=(size_t)(img.width+1)*GABOR_FILTERS;
+    t->height=img.height;
+    t->width=img.width;
+    t->energy=(double*)calloc((img.height+1)*row, sizeof(double));
+    if(t->energy==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
 
-    int* labels=(int*)malloc(block_total*sizeof(int));
-    if(labels==NULL) {
+    gabor_bank bank=create_gabor_bank();
+    gabor_rows r={img, t, &bank, 0};
+    for(int s=0; s<GABOR_SCALES; s++)
+        r.halo=MAX(r.halo, bank.radius[s]);
+    parallelFor((img.height+GABOR_BAND-1)/GABOR_BAND, threads, gabor_band, &r);
+    add_columns(column_pass_double, t->energy, img.height, row, threads);
+    free_gabor_bank(bank);
+    return t;
+}
+
+//the RMS response of each filter over the block
+static void gabor_block(const void* tables, int y0, int x0, int y1, int x1, float* out) {
+    const gabor_tables* t=(const gabor_tables*)tables;
+    size_t row=(size_t)(t->width+1)*GABOR_FILTERS;
+    const double *a=t->energy+y0*row+x0*GABOR_FILTERS, *b=t->energy+y0*row+x1*GABOR_FILTERS;
+    const double *c=t->energy+y1*row+x0*GABOR_FILTERS, *d=t->energy+y1*row+x1*GABOR_FILTERS;
+    double count=(double)(y1-y0)*(x1-x0);
+    for(int f=0; f<GABOR_FILTERS; f++) {
+        double energy=(d[f]-b[f]-c[f]+a[f])/count;
+        out[f]=(float)sqrt(energy>0.0 ? energy : 0.0);
+    }
+}
+
+static void gabor_release(void* tables) {
+    free(((gabor_tables*)tables)->energy);
+    free(tables);
+}
+
+static const char* const stats_names[]={"mean", "stddev"};
+static const char* const lbp_names[LBP_BINS]={"lbp0", "lbp1", "lbp2", "lbp3", "lbp4", "lbp5", "lbp6", "lbp7",
+                                              "lbp8", "lbp_other"};
+static const char* const glcm_names[]={"glcm_contrast", "glcm_homogeneity", "glcm_correlation"};
+static const char* const gabor_names[GABOR_FILTERS]={"gabor4_0", "gabor4_45", "gabor4_90", "gabor4_135",
+                                                     "gabor8_0", "gabor8_45", "gabor8_90", "gabor8_135"};
+
+const feature_extractor feature_extractors[]={
+    {"stats", 2, stats_names, stats_prepare, stats_block, stats_release},
+    {"lbp", LBP_BINS, lbp_names, lbp_prepare, lbp_block, lbp_release},
+    {"glcm", 3, glcm_names, glcm_prepare, glcm_block, glcm_release},
+    {"gabor", GABOR_FILTERS, gabor_names, gabor_prepare, gabor_block, gabor_release},
+};
+const int feature_extractor_count=sizeof(feature_extractors)/sizeof(feature_extractors[0]);
+
+//how blocks are laid out and which features they get - those of the extractors in order, then the position
+//of the block
+typedef struct {
+    int block_size;
+    int stride;
+    int extractors;
+    const feature_extractor* extractor[MAX_EXTRACTORS];
+} feature_config;
+
+//funct to get the number of features of each block
+int feature_dims(const feature_config* cfg) {
+    int dims=2; //x, y
+    for(int e=0; e<cfg->extractors; e++)
+        dims+=cfg->extractor[e]->dims;
+    return dims;
+}
+
+//funct to select the extractors from a comma separated list of their names
+//returns 0 on an unknown name or too many of them
+int parse_extractors(char* names, feature_config* cfg) {
+    cfg->extractors=0;
+    for(char* name=strtok(names, ","); name!=NULL; name=strtok(NULL, ",")) {
+        int e;
+        for(e=0; e<feature_extractor_count && strcmp(name, feature_extractors[e].name)!=0; e++)
+            ;
+        if(e==feature_extractor_count || cfg->extractors==MAX_EXTRACTORS)
+            return 0;
+        cfg->extractor[cfg->extractors++]=&feature_extractors[e];
+    }
+    return cfg->extractors>0;
+}
+
+feature_set create_feature_set(int count, int dims) {
+    feature_set fs;
+    fs.count=count;
+    fs.dims=dims;
+    fs.values=(float*)malloc((size_t)count*dims*sizeof(float));
+    if(fs.values==NULL) {
         fprintf(stderr, "Memory allocation error\n");
         exit(1);
     }
-    feature_vec* centers=(feature_vec*)malloc(k* sizeof(feature_vec));
-    if(centers==NULL) {
+    return fs;
+}
+
+void free_feature_set(feature_set fs) {
+    free(fs.values);
+}
+
+//funct to copy feature vector i into v
+static inline void get_features(const feature_set* fs, int i, float* v) {
+    for(int j=0; j<fs->dims; j++)
+        v[j]=fs->values[(size_t)j*fs->count+i];
+}
+
+//centers are stored like feature sets, feature j of center c at centers[j*stride+c], with the stride
+//rounded up to whole CENTER_LANES so the distances to them are computed lane by lane
+//center_dists reads the padding too, so it must be zeroed - callers allocate centers with calloc - and
+//closest_centers ignores the distances to it
+
+//funct to get the stride of the features of k centers
+int center_stride(int k) {
+    return (k+CENTER_LANES-1)/CENTER_LANES*CENTER_LANES;
+}
+
+//funct to get the squared distance of feature vector v to center c
+static inline float center_dist(const float* v, const float* centers, int stride, int dims, int c) {
+    float dist=0.0f;
+    for(int j=0; j<dims; j++) {
+        float d=v[j]-centers[(size_t)j*stride+c];
+        dist+=d*d;
+    }
+    return dist;
+}
+
+//funct to get the squared distances of feature vector v to all centers, padding included
+//feature by feature, with the distances to CENTER_LANES centers in one vector register
+static void center_dists(const float* v, const float* centers, int stride, int dims, float* dist) {
+    int c=0;
+#if defined(__AVX2__)
+    for(; c+8<=stride; c+=8) {
+        __m256 acc=_mm256_setzero_ps();
+        for(int j=0; j<dims; j++) {
+            __m256 d=_mm256_sub_ps(_mm256_set1_ps(v[j]), _mm256_loadu_ps(centers+(size_t)j*stride+c));
+#if defined(__FMA__)
+            acc=_mm256_fmadd_ps(d, d, acc);
+#else
+            acc=_mm256_add_ps(acc, _mm256_mul_ps(d, d));
+#endif
+        }
+        _mm256_storeu_ps(dist+c, acc);
+    }
+#endif
+#if defined(__SSE2__)
+    for(; c+4<=stride; c+=4) {
+        __m128 acc=_mm_setzero_ps();
+        for(int j=0; j<dims; j++) {
+            __m128 d=_mm_sub_ps(_mm_set1_ps(v[j]), _mm_loadu_ps(centers+(size_t)j*stride+c));
+            acc=_mm_add_ps(acc, _mm_mul_ps(d, d));
+        }
+        _mm_storeu_ps(dist+c, acc);
+    }
+#endif
+    for(; c<stride; c++)
+        dist[c]=center_dist(v, centers, stride, dims, c);
+}
+
+//funct to find the closest and second closest of the k centers to feature vector v, dist being scratch space
+//for the distances to all of them
+//with AVX2 each of 8 lanes keeps the closest two of its centers - no branches - and the lanes are merged
+//at the end, ties going to the lower center like in the scalar scan
+//returns the closest, the distances - not squared - go to *first and *second
+static int closest_centers(const float* v, const float* centers, int k, int stride, int dims, float* dist,
+                           float* first, float* second) {
+    center_dists(v, centers, stride, dims, dist);
+    float d1=FLT_MAX, d2=FLT_MAX;
+    int best=0, c=0;
+#if defined(__AVX2__)
+    for(int p=k; p<stride; p++)
+        dist[p]=FLT_MAX; //padding
+    if(stride>=8) {
+        __m256 m1=_mm256_set1_ps(FLT_MAX), m2=m1;
+        __m256i index=_mm256_setzero_si256(), lane=_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        for(; c+8<=stride; c+=8) {
+            __m256 d=_mm256_loadu_ps(dist+c);
+            __m256 closer=_mm256_cmp_ps(d, m1, _CMP_LT_OQ);
+            m2=_mm256_blendv_ps(_mm256_min_ps(m2, d), m1, closer);
+            m1=_mm256_min_ps(m1, d);
+            index=_mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(index), _mm256_castsi256_ps(lane), closer));
+            lane=_mm256_add_epi32(lane, _mm256_set1_epi32(8));
+        }
+        float lane1[8], lane2[8];
+        int laneBest[8];
+        _mm256_storeu_ps(lane1, m1);
+        _mm256_storeu_ps(lane2, m2);
+        _mm256_storeu_si256((__m256i*)laneBest, index);
+        int l0=0;
+        for(int l=1; l<8; l++)
+            if(lane1[l]<lane1[l0] || (lane1[l]==lane1[l0] && laneBest[l]<laneBest[l0]))
+                l0=l;
+        d1=lane1[l0];
+        best=laneBest[l0];
+        for(int l=0; l<8; l++) {
+            if(l!=l0 && lane1[l]<d2)
+                d2=lane1[l];
+            if(lane2[l]<d2)
+                d2=lane2[l];
+        }
+    }
+#endif
+    for(; c<k; c++) {
+        if(dist[c]<d1) {
+            d2=d1;
+            d1=dist[c];
+            best=c;
+        } else if(dist[c]<d2)
+            d2=dist[c];
+    }
+    *first=sqrtf(d1);
+    *second=sqrtf(d2);
+    return best;
+}
+
+//shared state of k-means++ seeding: every task keeps the distances of a chunk of feature vectors to their
+//closest center so far up to date, and their sum
+typedef struct {
+    const feature_set* fs;
+    const float* centers;
+    int stride;
+    int c; //newest center
+    float* closest;
+    double* totals; //per chunk
+    float* vectors; //scratch, dims per chunk
+} seed_state;
+
+static void seed_chunk(void* arg, int t) {
+    seed_state* s=(seed_state*)arg;
+    int first=t*KMEANS_CHUNK, last=MIN(first+KMEANS_CHUNK, s->fs->count);
+    float* v=s->vectors+(size_t)t*s->fs->dims;
+    double total=0.0;
+    for(int i=first; i<last; i++) {
+        get_features(s->fs, i, v);
+        float dist=center_dist(v, s->centers, s->stride, s->fs->dims, s->c);
+        if(s->c==0 || dist<s->closest[i])
+            s->closest[i]=dist;
+        total+=s->closest[i];
+    }
+    s->totals[t]=total;
+}
+
+//funct to seed k centers with k-means++: the first is a random feature, each next one a feature picked with
+//probability proportional to its squared distance to the closest center so far, which spreads the seeds
+//over the clusters and saves iterations
+//the distances are updated in parallel chunks
+void kmeans_pp_seed(const feature_set* fs, int k, float* centers, int threads) {
+    int n=fs->count, chunks=(n+KMEANS_CHUNK-1)/KMEANS_CHUNK, stride=center_stride(k);
+    seed_state s={fs, centers, stride, 0, (float*)malloc(n*sizeof(float)), (double*)malloc(chunks*sizeof(double)),
+                  (float*)malloc((size_t)chunks*fs->dims*sizeof(float))};
+    if(s.closest==NULL || s.totals==NULL || s.vectors==NULL) {
         fprintf(stderr, "Memory allocation error\n");
         exit(1);
     }
 
-    //init centers randomly
-    srand(0);
-    int i;
-    for(i=0; i<k; i++) {
-        int index=rand()%block_total;
-        centers[i]=features[index];
+    int pick=rand()%n;
+    for(int c=0; c<k; c++) {
+        for(int j=0; j<fs->dims; j++)
+            centers[(size_t)j*stride+c]=fs->values[(size_t)j*n+pick];
+        if(c==k-1)
+            break;
+        s.c=c;
+        parallelFor(chunks, threads, seed_chunk, &s);
+
+        double total=0.0;
+        for(int t=0; t<chunks; t++)
+            total+=s.totals[t];
+
+        //all features on the centers - any one will do
+        pick=rand()%n;
+        if(total>0.0) {
+            double target=rand()/(RAND_MAX+1.0)*total;
+            int t;
+            for(t=0; t<chunks-1 && target>=s.totals[t]; t++)
+                target-=s.totals[t];
+            int last=MIN((t+1)*KMEANS_CHUNK, n);
+            for(pick=t*KMEANS_CHUNK; pick<last-1 && (target-=s.closest[pick])>=0.0; pick++)
+                ;
+        }
     }
+    free(s.closest);
+    free(s.totals);
+    free(s.vectors);
+}
 
-    int iter,c;
-    for(iter=0; iter<max_itr; iter++) {
-        int changes=0;
+//shared state of parallel k-means; each task assigns a chunk of feature vectors and sums them up per cluster
+//into buffers of its own, which are reduced in chunk order - so the result doesn't depend on the threads
+typedef struct {
+    const feature_set* fs;
+    int k;
+    int stride; //of the centers
+    const float* centers;
+    int* labels;
+    float* upper;
+    float* lower;
+    const float* moved;
+    const float* half;
+    int farthest;
+    float second_farthest;
+    int bounded; //0 - first assignment, with all distances
+    //per chunk
+    float* vectors;  //dims
+    float* dists;    //stride
+    double* sums;    //k*dims, feature j of cluster c at [c*dims+j]
+    int* counts;     //k
+    int* changes;
+    long long* computed;
+} kmeans_state;
+
+//funct to assign the feature vectors of chunk t to their clusters and sum them up per cluster
+//see kmeans for the bounds
+static void assign_chunk(void* arg, int t) {
+    kmeans_state* s=(kmeans_state*)arg;
+    int k=s->k, stride=s->stride, dims=s->fs->dims;
+    int first=t*KMEANS_CHUNK, last=MIN(first+KMEANS_CHUNK, s->fs->count);
+    float* v=s->vectors+(size_t)t*dims;
+    float* dist=s->dists+(size_t)t*stride;
+    double* sums=s->sums+(size_t)t*k*dims;
+    int* counts=s->counts+(size_t)t*k;
+    int changes=0;
+    long long computed=0;
+
+    memset(sums, 0, (size_t)k*dims*sizeof(double));
+    memset(counts, 0, k*sizeof(int));
+    for(int i=first; i<last; i++) {
+        int a=-1; //labels are only read once the first pass has set them all
+        if(s->bounded) {
+            a=s->labels[i];
+            s->upper[i]+=s->moved[a];
+            s->lower[i]-=a==s->farthest ? s->second_farthest : s->moved[s->farthest];
+            float bound=s->half[a]>s->lower[i] ? s->half[a] : s->lower[i];
+            if(s->upper[i]<=bound)
+                continue;
+
+            //tighten the upper bound, then check all centers if that isn't enough
+            get_features(s->fs, i, v);
+            s->upper[i]=sqrtf(center_dist(v, s->centers, stride, dims, a));
+            computed++;
+            if(s->upper[i]<=bound)
+                continue;
+        } else
+            get_features(s->fs, i, v);
+
+        computed+=k;
+        s->labels[i]=closest_centers(v, s->centers, k, stride, dims, dist, &s->upper[i], &s->lower[i]);
+        changes+=s->labels[i]!=a;
+    }
+
+    //sum up the chunk, the features of a vector into independent sums
+    for(int i=first; i<last; i++) {
+        double* sum=sums+(size_t)s->labels[i]*dims;
+        for(int j=0; j<dims; j++)
+            sum[j]+=s->fs->values[(size_t)j*s->fs->count+i];
+        counts[s->labels[i]]++;
+    }
+    s->changes[t]=changes;
+    s->computed[t]=computed;
+}
+
+//funct to allocate the buffers of k-means on a feature set, centers and labels belonging to the caller
+static kmeans_state create_kmeans_state(const feature_set* fs, int k, const float* centers, int* labels) {
+    int n=fs->count, dims=fs->dims, chunks=(n+KMEANS_CHUNK-1)/KMEANS_CHUNK, stride=center_stride(k);
+    kmeans_state s={fs, k, stride, centers, labels, (float*)malloc(n*sizeof(float)), (float*)malloc(n*sizeof(float)),
+                    NULL, NULL, 0, 0.0f, 0,
+                    (float*)malloc((size_t)chunks*dims*sizeof(float)), (float*)malloc((size_t)chunks*stride*sizeof(float)),
+                    (double*)malloc((size_t)chunks*k*dims*sizeof(double)), (int*)malloc((size_t)chunks*k*sizeof(int)),
+                    (int*)malloc(chunks*sizeof(int)), (long long*)malloc(chunks*sizeof(long long))};
+    if(s.upper==NULL || s.lower==NULL || s.vectors==NULL || s.dists==NULL || s.sums==NULL || s.counts==NULL ||
+       s.changes==NULL || s.computed==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    return s;
+}
+
+static void free_kmeans_state(kmeans_state s) {
+    free(s.upper);
+    free(s.lower);
+    free(s.vectors);
+    free(s.dists);
+    free(s.sums);
+    free(s.counts);
+    free(s.changes);
+    free(s.computed);
+}
+
+//funct to label each feature vector with its closest of the k centers, with the given number of threads
+void assign_labels(const feature_set* fs, int k, const float* centers, int* labels, int threads) {
+    kmeans_state s=create_kmeans_state(fs, k, centers, labels);
+    parallelFor((fs->count+KMEANS_CHUNK-1)/KMEANS_CHUNK, threads, assign_chunk, &s);
+    free_kmeans_state(s);
+}
+
+//funct to cluster the feature vectors into k clusters, starting from the given centers, with the given number
+//of threads (0 - one per processor)
+//Hamerly's k-means: every feature keeps an upper bound on the distance to its center and a lower bound on
+//the distance to any other one, both loosened by how far the centers move; while the upper bound is below the
+//lower bound or half the distance from its center to the next one, the triangle inequality says the center
+//can't change and the k distances aren't computed - after the first few iterations, for most features
+//all buffers are allocated once; returns the number of iterations, labels get the cluster of each feature
+int kmeans(const feature_set* fs, int k, int max_itr, float* centers, int* labels, int threads) {
+    int n=fs->count, dims=fs->dims, chunks=(n+KMEANS_CHUNK-1)/KMEANS_CHUNK, stride=center_stride(k);
+    float* moved=(float*)malloc(k*sizeof(float));
+    float* half=(float*)malloc(k*sizeof(float)); //half the distance to the closest other center
+    float* old=(float*)malloc(dims*sizeof(float));
+    if(moved==NULL || half==NULL || old==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    kmeans_state s=create_kmeans_state(fs, k, centers, labels);
+    s.moved=moved;
+    s.half=half;
+
+    long long computed=0;
+    int iter;
+    for(iter=0; ; iter++) {
         //assignment step
-        for(i=0; i<block_total; i++) {
-            int min_index=-1;
-            float min_dist=FLT_MAX;
-            for(c=0; c<k; c++) {
-                float dx=features[i].mean-centers[c].mean;
-                float dy=features[i].stddev-centers[c].stddev;
-                float dxx=features[i].x-centers[c].x;
-                float dyy=features[i].y-centers[c].y;
-                float dist=dx*dx+dy*dy + dxx*dxx+dyy*dyy;
-                if(dist<min_dist) {
-                    min_dist=dist;
-                    min_index=c;
+        parallelFor(chunks, threads, assign_chunk, &s);
+        int changes=0;
+        for(int t=0; t<chunks; t++) {
+            changes+=s.changes[t];
+            computed+=s.computed[t];
+        }
+        if((s.bounded && changes== 0) || iter==max_itr)
+            break;
+
+        //update step: reduce the sums of the chunks, remembering how far each center moves
+        for(int t=1; t<chunks; t++) {
+            const double* sums=s.sums+(size_t)t*k*dims;
+            const int* counts=s.counts+(size_t)t*k;
+            for(int e=0; e<k*dims; e++)
+                s.sums[e]+=sums[e];
+            for(int c=0; c<k; c++)
+                s.counts[c]+=counts[c];
+        }
+        s.farthest=0;
+        for(int c=0; c<k; c++) {
+            moved[c]=0.0f;
+            if(s.counts[c]>0) {
+                for(int j=0; j<dims; j++) {
+                    old[j]=centers[(size_t)j*stride+c];
+                    centers[(size_t)j*stride+c]=(float)(s.sums[(size_t)c*dims+j]/s.counts[c]);
                 }
+                moved[c]=sqrtf(center_dist(old, centers, stride, dims, c));
             }
-            if(labels[i]!=min_index) {
-                labels[i]=min_index;
-                changes++;
-            }
+            if(moved[c]>moved[s.farthest])
+                s.farthest=c;
         }
-        //update step
-        feature_vec* new_centers=(feature_vec*)calloc(k, sizeof(feature_vec));
-        int* counts=(int*)calloc(k, sizeof(int));
-        if(new_centers==NULL || counts==NULL) {
-            fprintf(stderr, "Memory allocation error\n");
-            exit(1);
-        }
-        for(i=0; i<block_total; i++) {
-            int cluster=labels[i];
-            new_centers[cluster].mean+=features[i].mean;
-            new_centers[cluster].stddev+=features[i].stddev;
-            new_centers[cluster].x+=features[i].x;
-            new_centers[cluster].y+=features[i].y;
-            counts[cluster]++;
-        }
-        for(c=0; c<k; c++) {
-            if(counts[c]> 0) {
-                centers[c].mean= new_centers[c].mean/counts[c];
-                centers[c].stddev =new_centers[c].stddev/counts[c];
-                centers[c].x=new_centers[c].x/counts[c];
-                centers[c].y=new_centers[c].y/counts[c];
+        s.second_farthest=0.0f;
+        for(int c=0; c<k; c++)
+            if(c!=s.farthest && moved[c]>s.second_farthest)
+                s.second_farthest=moved[c];
+
+        for(int c=0; c<k; c++) {
+            float nearest=FLT_MAX;
+            for(int j=0; j<dims; j++)
+                old[j]=centers[(size_t)j*stride+c];
+            for(int o=0; o<k; o++) {
+                float dist=center_dist(old, centers, stride, dims, o);
+                if(o!=c && dist<nearest)
+                    nearest=dist;
             }
+            half[c]=0.5f*sqrtf(nearest);
         }
-        free(new_centers);
-        free(counts);
-        if(changes== 0)
-            break;
+        s.bounded=1;
     }
+    printf("K-means: %d iterations, %.1f%% of the distances computed\n", iter,
+           100.0*computed/((double)n*k*(iter+1)));
 
-    //create output image
-    Image op_img=createImage(height, width);
+    free(moved);
+    free(half);
+    free(old);
+    free_kmeans_state(s);
+    return iter;
+}
 
-    //generate colors for each cluster
-    unsigned char* colors=(unsigned char*)malloc(k*3*sizeof(unsigned char)); //rgb for each cluster
+//shared state of computing block features, row of blocks by row
+typedef struct {
+    const feature_config* cfg;
+    void* tables[MAX_EXTRACTORS];
+    feature_set* features;
+    int height, width;
+    int block_col;
+} block_extraction;
+
+//funct to compute the features of the blocks in block row by
+static void extract_row(void* arg, int by) {
+    block_extraction* x=(block_extraction*)arg;
+    const feature_config* cfg=x->cfg;
+    int stride=cfg->stride, block_size=cfg->block_size, count=x->features->count;
+    int margin=(block_size-stride)/2; //of the block around its cell
+    float* v=(float*)malloc(x->features->dims*sizeof(float));
+
+    for(int bx=0; bx<x->block_col; bx++) {
+        int x0=bx*stride;
+        int y0=by*stride;
+        int block_idx=by*x->block_col+bx;
+        //the block, clipped to the image
+        int top=MAX(y0-margin, 0), left=MAX(x0-margin, 0);
+        int bottom=MIN(y0-margin+block_size, x->height), right=MIN(x0-margin+block_size, x->width);
+
+        int j=0;
+        for(int e=0; e<cfg->extractors; e++) {
+            cfg->extractor[e]->block(x->tables[e], top, left, bottom, right, v+j);
+            j+=cfg->extractor[e]->dims;
+        }
+        v[j++]=(float)(x0+stride/2)/x->width;
+        v[j++]=(float)(y0+stride/2)/x->height;
+        for(j=0; j<x->features->dims; j++)
+            x->features->values[(size_t)j*count+block_idx]=v[j];
+    }
+    free(v);
+}
+
+//funct to compute the features of the blocks of an image with the given number of threads
+//there is a block every stride pixels, centered on its stride x stride cell, whose features - see feature_config -
+//come from the block_size x block_size pixels around it - with stride < block_size the blocks overlap
+//the extractors prepare their tables once, then each block takes a few lookups into them
+//the blocks are in raster order, (width+stride-1)/stride of them per row
+feature_set block_features(Image inp_img, const feature_config* cfg, int threads) {
+    int block_col=(inp_img.width+cfg->stride-1)/cfg->stride;
+    int block_row=(inp_img.height+cfg->stride-1)/cfg->stride;
+    feature_set features=create_feature_set(block_col*block_row, feature_dims(cfg));
+
+    block_extraction x={cfg, {NULL}, &features, inp_img.height, inp_img.width, block_col};
+    for(int e=0; e<cfg->extractors; e++)
+        x.tables[e]=cfg->extractor[e]->prepare(inp_img, threads);
+    parallelFor(block_row, threads, extract_row, &x);
+    for(int e=0; e<cfg->extractors; e++)
+        cfg->extractor[e]->release(x.tables[e]);
+    return features;
+}
+
+//funct to generate a random color for each of k clusters - rgb, 3 bytes per cluster
+unsigned char* cluster_colors(int k) {
+    unsigned char* colors=(unsigned char*)malloc(k*3*sizeof(unsigned char));
     if(colors==NULL) {
         fprintf(stderr, "Memory allocation error\n");
         exit(1);
     }
-    for(i=0; i<k; i++) {
+    for(int i=0; i<k; i++) {
         colors[i*3+0]=rand()%256; //r
         colors[i*3+1]=rand()%256; //g
         colors[i*3+2]=rand()%256; //b
     }
+    return colors;
+}
+
+//funct to create the output image, the cell of each block in the color of its cluster
+Image paint_labels(int height, int width, int stride, const int* labels, const unsigned char* colors) {
+    Image op_img=createImage(height, width);
+    int block_col=(width+stride-1)/stride;
+    int block_row=(height+stride-1)/stride;
 
-    block_idx=0;
-    //assign colors to each block
-    for(by=0; by<block_row; by++) {
-        for(bx=0; bx < block_col; bx++) {
+    int block_idx=0;
+    for(int by=0; by<block_row; by++) {
+        for(int bx=0; bx < block_col; bx++) {
             int label=labels[block_idx];
             unsigned char r=colors[label*3+0];
             unsigned char g =colors[label*3+1];
             unsigned char b=colors[label*3+2];
-            int x0=bx*BLOCK_SIZE;
-            int y0=by*BLOCK_SIZE;
+            int x0=bx*stride;
+            int y0=by*stride;
 
-            for(m=y0; m<y0+BLOCK_SIZE && m<height; m++) {
-                for(n=x0; n<x0+BLOCK_SIZE && n<width; n++) {
+            for(int m=y0; m<y0+stride && m<height; m++) {
+                for(int n=x0; n<x0+stride && n<width; n++) {
                     op_img.map[m][n].r=r;
                     op_img.map[m][n].g=g;
                     op_img.map[m][n].b=b;
@@ -170,7 +1089,37 @@ Image segment_texture(Image inp_img, int segments) {
             block_idx++;
         }
     }
-    free(features);
+    return op_img;
+}
+
+//funct to segment textures, see block_features
+Image segment_texture(Image inp_img, int segments, const feature_config* cfg, int threads) {
+    feature_set features=block_features(inp_img, cfg, threads);
+
+    //kmeans clustering
+    int k=segments;
+    int max_itr=100;
+
+    int* labels=(int*)malloc(features.count*sizeof(int));
+    if(labels==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    float* centers=(float*)calloc((size_t)center_stride(k)*features.dims, sizeof(float));
+    if(centers==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+
+    srand(0);
+    kmeans_pp_seed(&features, k, centers, threads);
+    kmeans(&features, k, max_itr, centers, labels, threads);
+
+    //create output image
+    unsigned char* colors=cluster_colors(k);
+    Image op_img=paint_labels(inp_img.height, inp_img.width, cfg->stride, labels, colors);
+
+    free_feature_set(features);
     free(labels);
     free(centers);
     free(colors);
@@ -178,16 +1127,234 @@ Image segment_texture(Image inp_img, int segments) {
     return op_img;
 }
 
+//the images of a dataset, each with the file its segmentation goes to
+typedef struct {
+    int count;
+    char** inputs;
+    char** outputs;
+} image_list;
+
+//funct to read a list of images, one "input output" pair of file names per line
+image_list read_image_list(const char* fname) {
+    image_list list={0, NULL, NULL};
+    FILE* file=fopen(fname, "r");
+    if(file==NULL) {
+        fprintf(stderr, "Can't open image list %s.\n", fname);
+        exit(1);
+    }
+
+    char inp[1024], op[1024];
+    int capacity=0;
+    while(fscanf(file, "%1023s %1023s", inp, op)==2) {
+        if(list.count==capacity) {
+            capacity=capacity>0 ? 2*capacity : 16;
+            list.inputs=(char**)realloc(list.inputs, capacity*sizeof(char*));
+            list.outputs=(char**)realloc(list.outputs, capacity*sizeof(char*));
+        }
+        list.inputs[list.count]=strdup(inp);
+        list.outputs[list.count]=strdup(op);
+        list.count++;
+    }
+    fclose(file);
+    return list;
+}
+
+void free_image_list(image_list list) {
+    for(int i=0; i<list.count; i++) {
+        free(list.inputs[i]);
+        free(list.outputs[i]);
+    }
+    free(list.inputs);
+    free(list.outputs);
+}
+
+//funct to update the centers with a mini-batch: each vector is assigned to its closest center, which then moves
+//towards it by 1/(vectors it has seen), so every center is the running mean of the vectors assigned to it
+static void minibatch_step(const feature_set* batch, int k, float* centers, long long* seen, int* labels,
+                           int threads) {
+    int stride=center_stride(k);
+    assign_labels(batch, k, centers, labels, threads);
+    for(int i=0; i<batch->count; i++) {
+        int c=labels[i];
+        float eta=1.0f/(float)++seen[c];
+        for(int j=0; j<batch->dims; j++) {
+            float* center=&centers[(size_t)j*stride+c];
+            *center+=eta*(batch->values[(size_t)j*batch->count+i]-*center);
+        }
+    }
+}
+
+//shared state of labeling the images of a dataset against a codebook
+typedef struct {
+    image_list list;
+    int k;
+    const float* centers;
+    const unsigned char* colors;
+    const feature_config* cfg;
+} dataset_labeling;
+
+//funct to label image t of the dataset and write its segmentation
+static void label_image(void* arg, int t) {
+    dataset_labeling* d=(dataset_labeling*)arg;
+    Image inp_img=readImage(d->list.inputs[t]);
+    feature_set features=block_features(inp_img, d->cfg, 1);
+    int* labels=(int*)malloc(features.count*sizeof(int));
+    if(labels==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+
+    assign_labels(&features, d->k, d->centers, labels, 1);
+    Image op_img=paint_labels(inp_img.height, inp_img.width, d->cfg->stride, labels, d->colors);
+    writeImage(op_img, d->list.outputs[t]);
+
+    deleteImage(inp_img);
+    deleteImage(op_img);
+    free_feature_set(features);
+    free(labels);
+}
+
+//funct to segment the textures of a whole dataset with one shared codebook, so that clusters - and colors -
+//mean the same in every image
+//mini-batch k-means streams over the images: the blocks of one image at a time are shuffled and fed in batches
+//of batch_size, for the given number of epochs, the centers seeded with k-means++ on the first image; only
+//one image and one batch are in memory at a time. Then the images are labeled against the codebook in parallel,
+//one per thread. The codebook goes to a CSV file, one cluster per line
+void segment_dataset(const char* list_fname, int segments, const char* codebook_fname, const feature_config* cfg,
+                     int batch_size, int epochs, int threads) {
+    image_list list=read_image_list(list_fname);
+    if(list.count==0) {
+        fprintf(stderr, "No images in %s.\n", list_fname);
+        exit(1);
+    }
+
+    int k=segments, stride_c=center_stride(k), dims=feature_dims(cfg);
+    float* centers=(float*)calloc((size_t)stride_c*dims, sizeof(float));
+    long long* seen=(long long*)calloc(k, sizeof(long long));
+    feature_set batch=create_feature_set(batch_size, dims);
+    int* labels=(int*)malloc(batch_size*sizeof(int));
+    if(centers==NULL || seen==NULL || labels==NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+
+    srand(0);
+    for(int e=0; e<epochs; e++) {
+        for(int t=0; t<list.count; t++) {
+            Image inp_img=readImage(list.inputs[t]);
+            feature_set features=block_features(inp_img, cfg, threads);
+            deleteImage(inp_img);
+            if(e==0 && t==0)
+                kmeans_pp_seed(&features, k, centers, threads);
+
+            //shuffle the blocks, then feed them batch by batch
+            int* order=(int*)malloc(features.count*sizeof(int));
+            if(order==NULL) {
+                fprintf(stderr, "Memory allocation error\n");
+                exit(1);
+            }
+            for(int i=0; i<features.count; i++)
+                order[i]=i;
+            for(int i=features.count-1; i>0; i--) {
+                int r=rand()%(i+1), tmp=order[i];
+                order[i]=order[r];
+                order[r]=tmp;
+            }
+            for(int first=0; first<features.count; first+=batch_size) {
+                batch.count=MIN(batch_size, features.count-first);
+                for(int j=0; j<dims; j++)
+                    for(int i=0; i<batch.count; i++)
+                        batch.values[(size_t)j*batch.count+i]=features.values[(size_t)j*features.count+order[first+i]];
+                minibatch_step(&batch, k, centers, seen, labels, threads);
+            }
+            free(order);
+            free_feature_set(features);
+        }
+        printf("Epoch %d of %d done\n", e+1, epochs);
+    }
+
+    //write the codebook
+    unsigned char* colors=cluster_colors(k);
+    FILE* file=fopen(codebook_fname, "w");
+    if(file==NULL) {
+        fprintf(stderr, "Can't write codebook %s.\n", codebook_fname);
+        exit(1);
+    }
+    fprintf(file, "cluster,blocks");
+    for(int e=0; e<cfg->extractors; e++)
+        for(int j=0; j<cfg->extractor[e]->dims; j++)
+            fprintf(file, ",%s", cfg->extractor[e]->feature_names[j]);
+    fprintf(file, ",x,y,r,g,b\n");
+    for(int c=0; c<k; c++) {
+        fprintf(file, "%d,%lld", c, seen[c]);
+        for(int j=0; j<dims; j++)
+            fprintf(file, ",%g", centers[(size_t)j*stride_c+c]);
+        fprintf(file, ",%d,%d,%d\n", colors[c*3+0], colors[c*3+1], colors[c*3+2]);
+    }
+    fclose(file);
+
+    dataset_labeling d={list, k, centers, colors, cfg};
+    parallelFor(list.count, threads, label_image, &d);
+    printf("Labeled %d images against a codebook of %d clusters\n", list.count, k);
+
+    free_image_list(list);
+    free_feature_set(batch);
+    free(centers);
+    free(seen);
+    free(labels);
+    free(colors);
+}
+
 int main(int argc, char** argv) {
-    char* inp_fname=argv[1];
-    int segments=atoi(argv[2]);
-    char* op_fname=argv[3];
+    //with -dataset: a list of images, the number of segments and the file for the codebook
+    int dataset=argc>1 && strcmp(argv[1], "-dataset")==0;
+    char* inp_fname=argv[1+dataset];
+    int segments=atoi(argv[2+dataset]);
+    char* op_fname=argv[3+dataset];
+    feature_config cfg={BLOCK_SIZE, 0, 1, {&feature_extractors[0]}}; //stats; stride 0 - block_size, blocks side by side
+    int threads=0; //0 - one per processor
+    int batch_size=4096;
+    int epochs=1;
+
+    for(int a=4+dataset; a<argc; a++) {
+        if(strcmp(argv[a], "-block")==0 && a+1<argc)
+            cfg.block_size=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-stride")==0 && a+1<argc)
+            cfg.stride=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-features")==0 && a+1<argc) {
+            if(!parse_extractors(argv[++a], &cfg)) {
+                fprintf(stderr, "The features are a comma separated list of stats, lbp, glcm and gabor.\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[a], "-threads")==0 && a+1<argc)
+            threads=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-batch")==0 && a+1<argc)
+            batch_size=atoi(argv[++a]);
+        else if(strcmp(argv[a], "-epochs")==0 && a+1<argc)
+            epochs=atoi(argv[++a]);
+    }
+    if(cfg.stride==0)
+        cfg.stride=cfg.block_size;
+    if(cfg.block_size<1 || cfg.stride<1 || cfg.stride>cfg.block_size) {
+        fprintf(stderr, "The block size must be positive and the stride between 1 and the block size.\n");
+        return 1;
+    }
+    if(batch_size<1 || epochs<1) {
+        fprintf(stderr, "The batch size and the number of epochs must be positive.\n");
+        return 1;
+    }
+
+    if(dataset) {
+        segment_dataset(inp_fname, segments, op_fname, &cfg, batch_size, epochs, threads);
+        return 0;
+    }
 
     //read input image
     Image inp_img=readImage(inp_fname);
 
     //segment texture
-    Image op_img=segment_texture(inp_img, segments);
+    Image op_img=segment_texture(inp_img, segments, &cfg, threads);
 
     //write the output image
     writeImage(op_img, op_fname);